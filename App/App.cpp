@@ -34,15 +34,24 @@
 #include <time.h>
 #include <assert.h>
 #include <vector>
+#include <algorithm>
+#include <thread>
+#include <sched.h>
+#include <mutex>
+#include <string>
 
 # include <unistd.h>
 # include <pwd.h>
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
 # define MAX_PATH FILENAME_MAX
 
 #include "sgx_urts.h"
 #include "App.h"
 #include "Enclave_u.h"
 #include "data_structure.hpp"
+#include "dataset_format.h"
 #include "xxhash64.h"
 // #include "merklecpp.h"
 #include "merkletree.h"
@@ -50,12 +59,45 @@
 /* Global EID shared by multiple threads */
 sgx_enclave_id_t global_eid = 0;
 
+/* background index build started by build_index_async */
+std::thread index_thread;
+int lazy_index = 0;
+
 /* intermedian data storage */
 float * data;
 float * label; 
 int row;
 int col;
 
+/* rows served to the enclave: the loaded dataset, then every appended batch */
+typedef struct _row_segment_t {
+    float* data;
+    float* label;
+    size_t start;
+    size_t num;
+} row_segment_t;
+std::vector<row_segment_t> segments;
+std::mutex segments_lock; /* appends race with the index thread fetching rows */
+
+/* dataset file mapping, NULL when the data is copied in by load_data */
+void * mapped_base = NULL;
+size_t mapped_size = 0;
+
+/* chunked dataset inside the mapping, rows are then only served as verified chunks */
+dataset_header_t * dataset_header = NULL;
+dataset_chunk_t * dataset_chunks = NULL;
+uint8_t dataset_root[DATASET_HASH_LENGTH];
+int dataset_root_set = 0;
+
+/* CPU mask of set_threads for the enclave OpenMP team, the team is spawned by the first ecall
+ * running DNNL and its host threads keep the mask of the calling thread from then on */
+cpu_set_t team_mask;
+int team_pinning = 0; /* a mask waits for the team */
+int team_spawned = 0;
+
+/* sealed batch size cache of set_batch_autotune, empty when the default batch is used */
+std::string tune_path;
+
 typedef struct _sgx_errlist_t {
     sgx_status_t err;
     const char *msg;
@@ -189,7 +231,11 @@ void destroy_enclave(void)
 {
     // std::cout << "Destroying Enclave with id: " << eid << std::endl;
     printf("Destroying Enclave with id: %ld\n", global_eid);
+    if(index_thread.joinable()){
+        index_thread.join();
+    }
     sgx_destroy_enclave(global_eid);
+    unload_data_file();
 }
 
 
@@ -253,6 +299,14 @@ void test_merkle_tree(){
     mt_delete(tree);
 }
 
+void reset_segments(){
+    /* a chunked dataset has no plain row segment, the enclave reads it with ocall_fetch_chunk */
+    row_segment_t seg = {data, label, 0, (size_t)row};
+    std::lock_guard<std::mutex> guard(segments_lock);
+    segments.clear();
+    segments.push_back(seg);
+}
+
 void load_data(float* input_data, float* input_label, int r, int c){ //pay attention to double ** and double [][]
     data = (float*)malloc(r*c*sizeof(float));
     label = (float*)malloc(r*sizeof(float));
@@ -260,19 +314,419 @@ void load_data(float* input_data, float* input_label, int r, int c){ //pay atten
     memcpy(label, input_label, r*sizeof(float));
     row = r;
     col = c;
+    reset_segments();
     printf("data loaded into intermedian storage, size is (%d, %d)\n", r, c);
     test_merkle_tree();
 }
 
+/* 
+ * load_chunked_file:
+ *   Map a chunked dataset file (see dataset_format.h). Only the layout is
+ *   checked here, chunk hashes and the root are checked inside the enclave.
+ */
+int load_chunked_file(int fd, const char* path, int r, int c){
+    struct stat st;
+    dataset_header_t header;
+    if(fstat(fd, &st) != 0 || pread(fd, &header, sizeof(header), 0) != sizeof(header)
+        || header.rows != (uint64_t)r || header.cols != (uint32_t)c || header.chunk_rows == 0
+        || header.num_chunks != (header.rows+header.chunk_rows-1)/header.chunk_rows
+        || sizeof(header)+header.num_chunks*sizeof(dataset_chunk_t) > (size_t)st.st_size){
+        printf("Error: dataset file %s does not hold (%d, %d) rows\n", path, r, c);
+        close(fd);
+        return -1;
+    }
+    void* base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED){
+        printf("Error: can not map dataset file %s\n", path);
+        return -1;
+    }
+    dataset_chunk_t* chunks = (dataset_chunk_t*)((char*)base+sizeof(header));
+    for(uint64_t i=0; i<header.num_chunks; i++){
+        if(chunks[i].offset > (uint64_t)st.st_size || chunks[i].size > (uint64_t)st.st_size-chunks[i].offset){
+            printf("Error: chunk %lu of %s is out of the file\n", (unsigned long)i, path);
+            munmap(base, st.st_size);
+            return -1;
+        }
+    }
+    madvise(base, st.st_size, MADV_SEQUENTIAL);
+    mapped_base = base;
+    mapped_size = st.st_size;
+    dataset_header = (dataset_header_t*)base;
+    dataset_chunks = chunks;
+    data = NULL;
+    label = NULL;
+    row = r;
+    col = c;
+    reset_segments();
+    printf("chunked data mapped from %s, size is (%d, %d) in %lu chunks\n", path, r, c, (unsigned long)header.num_chunks);
+    return 0;
+}
+
+/* 
+ * load_data_file:
+ *   Map a raw float32 dataset file (r*c data values followed by r labels)
+ *   instead of copying it, pages are brought in when the enclave asks for them.
+ */
+int load_data_file(const char* path, int r, int c){
+    size_t expect = (size_t)r*(c+1)*sizeof(float);
+    int fd = open(path, O_RDONLY);
+    if(fd < 0){
+        printf("Error: can not open dataset file %s\n", path);
+        return -1;
+    }
+    uint32_t magic = 0;
+    if(pread(fd, &magic, sizeof(magic), 0) == sizeof(magic) && magic == DATASET_MAGIC){
+        return load_chunked_file(fd, path, r, c);
+    }
+    struct stat st;
+    if(fstat(fd, &st) != 0 || (size_t)st.st_size != expect){
+        printf("Error: dataset file %s does not hold (%d, %d) rows\n", path, r, c);
+        close(fd);
+        return -1;
+    }
+    void* base = mmap(NULL, expect, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED){
+        printf("Error: can not map dataset file %s\n", path);
+        return -1;
+    }
+    madvise(base, expect, MADV_SEQUENTIAL);
+    mapped_base = base;
+    mapped_size = expect;
+    data = (float*)base;
+    label = data+(size_t)r*c;
+    row = r;
+    col = c;
+    reset_segments();
+    printf("data mapped from %s, size is (%d, %d)\n", path, r, c);
+    return 0;
+}
+
+void unload_data_file(){
+    if(mapped_base != NULL){
+        munmap(mapped_base, mapped_size);
+        mapped_base = NULL;
+        mapped_size = 0;
+        dataset_header = NULL;
+        dataset_chunks = NULL;
+    }
+}
+
+/* 
+ * set_dataset_root:
+ *   Pin the root the enclave must see for a chunked dataset, as 64 hex digits.
+ *   Without it the enclave only checks the file against its own header.
+ */
+int set_dataset_root(const char* hex){
+    if(strlen(hex) != 2*DATASET_HASH_LENGTH){
+        printf("Error: dataset root must be %d hex digits\n", 2*DATASET_HASH_LENGTH);
+        return -1;
+    }
+    for(int i=0; i<DATASET_HASH_LENGTH; i++){
+        unsigned int byte;
+        if(sscanf(hex+2*i, "%2x", &byte) != 1){
+            printf("Error: dataset root is not hex\n");
+            return -1;
+        }
+        dataset_root[i] = byte;
+    }
+    dataset_root_set = 1;
+    return 0;
+}
+
+/* drop the pages of rows already handed to the enclave, they fault back in from the file if needed */
+void release_rows(size_t start, size_t num){
+    if(mapped_base == NULL || data == NULL || start >= (size_t)row){
+        return;
+    }
+    num = std::min(num, row-start);
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    uintptr_t begin = (uintptr_t)(data+start*col);
+    uintptr_t end = (uintptr_t)(data+(start+num)*col);
+    begin = (begin+page-1)/page*page;
+    end = end/page*page;
+    if(end > begin){
+        madvise((void*)begin, end-begin, MADV_DONTNEED);
+    }
+}
+
+void ocall_fetch_chunk(uint64_t index, uint8_t* buffer, size_t len){
+    if(dataset_header == NULL || index >= dataset_header->num_chunks || len != dataset_chunks[index].size){
+        return; /* the enclave hash check rejects whatever is left in buffer */
+    }
+    const dataset_chunk_t& chunk = dataset_chunks[index];
+    memcpy(buffer, (char*)mapped_base+chunk.offset, len);
+    /* drop the chunk pages, they fault back in from the file if needed */
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    uintptr_t begin = ((uintptr_t)mapped_base+chunk.offset+page-1)/page*page;
+    uintptr_t end = ((uintptr_t)mapped_base+chunk.offset+len)/page*page;
+    if(end > begin){
+        madvise((void*)begin, end-begin, MADV_DONTNEED);
+    }
+}
+
+void ocall_fetch_rows(size_t start, size_t num, float* data_out, size_t data_len, float* label_out){
+    (void)data_len;
+    size_t end = start+num;
+    std::lock_guard<std::mutex> guard(segments_lock);
+    for(size_t i=0; i<segments.size(); i++){
+        row_segment_t& seg = segments[i];
+        size_t from = std::max(start, seg.start);
+        size_t to = std::min(end, seg.start+seg.num);
+        if(seg.data == NULL || from >= to){
+            continue;
+        }
+        memcpy(data_out+(from-start)*col, seg.data+(from-seg.start)*col, (to-from)*col*sizeof(float));
+        memcpy(label_out+(from-start), seg.label+(from-seg.start), (to-from)*sizeof(float));
+    }
+    release_rows(start, num);
+}
+
+/* pin the calling thread to team_mask for one ecall that may spawn the team (begin 1), then give
+ * it its own mask back (begin 0): later host threads like the index builder are not pinned */
+void pin_team(int begin){
+    static cpu_set_t saved;
+    static int pinned = 0;
+    if(begin && team_pinning && !pinned){
+        sched_getaffinity(0, sizeof(saved), &saved);
+        if(sched_setaffinity(0, sizeof(team_mask), &team_mask) != 0){
+            printf("Warning: can not pin the enclave threads\n");
+            return;
+        }
+        pinned = 1;
+    }else if(!begin && pinned){
+        sched_setaffinity(0, sizeof(saved), &saved);
+        pinned = 0;
+    }
+}
+
+/* hand the sealed config at tune_path to the enclave, it either unseals a batch size measured for
+ * the same setup or calibrates one and returns a new sealed config that replaces the file */
+void tune_batch(){
+    std::vector<uint8_t> sealed;
+    FILE* f = fopen(tune_path.c_str(), "rb");
+    if(f != NULL){
+        uint8_t buf[4096];
+        size_t n = fread(buf, 1, sizeof(buf), f);
+        sealed.assign(buf, buf+n);
+        fclose(f);
+    }
+    std::vector<uint8_t> out(4096);
+    uint32_t out_len = 0;
+    int retval = -1;
+    sgx_status_t ret = ecall_tune_batch(global_eid, &retval, sealed.empty() ? NULL : sealed.data(),
+        sealed.size(), out.data(), out.size(), &out_len);
+    if(ret != SGX_SUCCESS){
+        print_error_message(ret);
+        return;
+    }
+    if(retval == 0 && out_len > 0){
+        f = fopen(tune_path.c_str(), "wb");
+        if(f == NULL || fwrite(out.data(), 1, out_len, f) != out_len){
+            printf("Warning: can not write the sealed batch config %s\n", tune_path.c_str());
+        }
+        if(f != NULL){
+            fclose(f);
+        }
+    }
+}
+
 void init_enclave_storage(){
-    ecall_init_enclave_storage(global_eid, data, label, row, col, global_eid);
+    if(dataset_header != NULL){
+        int retval = -1;
+        sgx_status_t ret = ecall_attach_dataset(global_eid, &retval, dataset_header, dataset_chunks,
+            dataset_header->num_chunks, dataset_root_set ? dataset_root : NULL);
+        if(ret != SGX_SUCCESS || retval != 0){
+            if(ret != SGX_SUCCESS){
+                print_error_message(ret);
+            }
+            printf("Error: enclave rejected the dataset file\n");
+            return;
+        }
+    }
+    int init_ret = -1;
+    sgx_status_t init_status = ecall_init_enclave_storage(global_eid, &init_ret, row, col, global_eid);
+    if(init_status != SGX_SUCCESS || init_ret != 0){
+        if(init_status != SGX_SUCCESS){
+            print_error_message(init_status);
+        }
+        printf("Error: enclave rejected the storage size\n");
+        return;
+    }
+    if(!tune_path.empty()){
+        pin_team(1);
+        tune_batch();
+        pin_team(0);
+    }
+    if(lazy_index){
+        build_index_async();
+    }
     sgx_status_t ret = SGX_SUCCESS;
     int retval = 0;
     // cnn_inference_f32_cpp(global_eid, &retval);
+    pin_team(1);
     ecall_training(global_eid);
+    pin_team(0);
+    //the team exists now, a later set_threads can not move it
+    team_pinning = 0;
+    team_spawned = 1;
+    if(ret != SGX_SUCCESS){
+        print_error_message(ret);
+    }
+}
+
+/* the enclave fetches the new rows back on every load pass, so they are copied into storage owned by the App.
+ * returns -1 without a loaded dataset to append to */
+int append_rows(float* rows, float* labels, int n){
+    {
+        std::lock_guard<std::mutex> guard(segments_lock);
+        if(segments.empty() || n <= 0){
+            printf("Error: append needs a dataset loaded by load_data or load_data_file and at least one row\n");
+            return -1;
+        }
+    }
+    row_segment_t seg;
+    seg.data = (float*)malloc((size_t)n*col*sizeof(float));
+    seg.label = (float*)malloc(n*sizeof(float));
+    memcpy(seg.data, rows, (size_t)n*col*sizeof(float));
+    memcpy(seg.label, labels, n*sizeof(float));
+    seg.num = n;
+    {
+        std::lock_guard<std::mutex> guard(segments_lock);
+        seg.start = segments.back().start+segments.back().num;
+        segments.push_back(seg);
+    }
+    sgx_status_t ret = ecall_append_rows(global_eid, n);
+    if(ret != SGX_SUCCESS){
+        print_error_message(ret);
+        return -1;
+    }
+    return 0;
+}
+
+/* with lazy index the enclave trains right away, the kid index is built by build_index_async or on first use */
+void set_lazy_index(int enable){
+    lazy_index = enable;
+    ecall_set_lazy_index(global_eid, enable);
+}
+
+void build_index_async(){
+    if(index_thread.joinable()){
+        return;
+    }
+    index_thread = std::thread([](){
+        sgx_status_t ret = ecall_build_index(global_eid);
+        if(ret != SGX_SUCCESS){
+            print_error_message(ret);
+        }
+    });
+}
+
+/* re-hash rows on every load pass and skip the ones whose digest changed */
+void set_digest_check(int enable){
+    ecall_set_digest_check(global_eid, enable);
+}
+
+/* 
+ * set_threads:
+ *   Number of DNNL/OpenMP threads inside the enclave. Their host threads are
+ *   created by the urts from the thread inside the ecall and inherit its CPU
+ *   mask, so the mask is set on the calling thread only for the ecall that
+ *   spawns the team (tuning or training in init_enclave_storage) and restored
+ *   after it. The policy therefore only takes effect before training starts;
+ *   later calls change the thread count but leave the existing team unpinned.
+ *   policy 0 keeps the mask, 1 compact (first num allowed CPUs), 2 scatter
+ *   (num CPUs spread evenly over the allowed set, e.g. one per physical core).
+ */
+void set_threads(int num, int policy){
+    static cpu_set_t allowed;
+    static int saved = 0;
+    if(!saved){
+        sched_getaffinity(0, sizeof(allowed), &allowed);
+        saved = 1;
+    }
+    std::vector<int> cpus;
+    for(int i=0; i<CPU_SETSIZE; i++){
+        if(CPU_ISSET(i, &allowed)){
+            cpus.push_back(i);
+        }
+    }
+    cpu_set_t mask = allowed;
+    if(policy != 0 && num > 0 && num < (int)cpus.size()){
+        CPU_ZERO(&mask);
+        for(int i=0; i<num; i++){
+            CPU_SET(cpus[policy == 1 ? i : i*cpus.size()/num], &mask);
+        }
+    }
+    if(team_spawned){
+        if(policy != 0){
+            printf("Warning: the enclave threads already run, policy %d is ignored\n", policy);
+        }
+    }else{
+        team_mask = mask;
+        team_pinning = policy != 0;
+    }
+    sgx_status_t ret = ecall_set_threads(global_eid, num);
+    if(ret != SGX_SUCCESS){
+        print_error_message(ret);
+    }
+}
+
+/* training samples/sec at 1..max_threads enclave threads, printed by the enclave */
+void thread_scaling(int max_threads, int steps){
+    sgx_status_t ret = ecall_thread_scaling(global_eid, max_threads, steps);
+    if(ret != SGX_SUCCESS){
+        print_error_message(ret);
+    }
+}
+
+/* 0 SGD, 1 momentum, 2 Adam; set before init_enclave_storage so the checkpoints get room for the state */
+void set_optimizer(int kind, float lr){
+    ecall_set_optimizer(global_eid, kind, lr);
+}
+
+/* synchronous data parallel training: every batch is split over num enclave threads, their
+ * gradients are summed and applied in one step; each thread gets an equal part of the DNNL threads */
+void set_workers(int num){
+    ecall_set_workers(global_eid, num);
+}
+
+/* 1 makes the workers of set_workers train Hogwild style: each thread trains on its own rows and
+ * updates the shared weights without locks, faster but not reproducible; set before training */
+void set_async(int enable){
+    ecall_set_async(global_eid, enable);
+}
+
+/* 1 prints the mean training loss of every epoch after each slice is trained */
+void set_loss_report(int enable){
+    ecall_set_loss_report(global_eid, enable);
+}
+
+/* 1 trains with bf16 primitives on fp32 master weights, checkpoints stay fp32; set before training */
+void set_precision(int bf16){
+    ecall_set_precision(global_eid, bf16);
+}
+
+/* pick the training batch size by timing candidates in the enclave and cache the choice sealed at
+ * path, later runs with the same setup on this machine reuse it; set before init_enclave_storage */
+void set_batch_autotune(const char* path){
+    tune_path = path;
+}
+
+/* layer list after the input like "128,tanh,1,sigmoid" (inner product widths and activations),
+ * the last two have to be 1,sigmoid or k,softmax for class labels 0..k-1; set before init_enclave_storage */
+void set_arch(const char* spec){
+    ecall_set_arch(global_eid, spec);
+}
+
+int contains(uint64_t kid){
+    int present = 0;
+    sgx_status_t ret = ecall_contains(global_eid, kid, &present);
     if(ret != SGX_SUCCESS){
         print_error_message(ret);
     }
+    return present;
 }
 
 void unlearning(uint64_t kid){
@@ -284,9 +738,9 @@ void unlearning(uint64_t kid){
     }
 }
 
-void ocall_init_model_storage(void** model, int* network, int len){
+void ocall_init_model_storage(void** model, int* network, int len, int state_count){
     Model** temp = (Model**)model;
-    Model* result = new Model(network, len);
+    Model* result = new Model(network, len, state_count);
     *temp = result;
 }
 
@@ -62,8 +62,25 @@ extern "C" {
 int initialize_enclave(void);
 void destroy_enclave(void);
 void load_data(float* input_data, float* input_label, int r, int c);
+int load_data_file(const char* path, int r, int c);
+void unload_data_file();
+int set_dataset_root(const char* hex);
 void init_enclave_storage();
 uint64_t xxhash(char* content, int len);
+int append_rows(float* rows, float* labels, int n);
+void set_lazy_index(int enable);
+void build_index_async();
+void set_digest_check(int enable);
+void set_optimizer(int kind, float lr);
+void set_arch(const char* spec);
+void set_batch_autotune(const char* path);
+void set_precision(int bf16);
+void set_workers(int num);
+void set_async(int enable);
+void set_loss_report(int enable);
+void set_threads(int num, int policy);
+void thread_scaling(int max_threads, int steps);
+int contains(uint64_t kid);
 void unlearning(uint64_t kid);
 void predict(float* data, float* label, int size);
 
@@ -31,10 +31,14 @@
 
 #include <stdarg.h>
 #include <stdio.h>      /* vsnprintf */
+#include <limits.h>
+#include <math.h>
 #include <map>
 #include <vector>
 #include <algorithm>
 #include <sgx_trts.h>
+#include <sgx_thread.h>
+#include <sgx_tseal.h>
 
 #include "Enclave.h"
 #include "Enclave_t.h"  /* print_string */
@@ -43,42 +47,37 @@
 #include "cuckoofilter.h"
 #include "sha256.h"
 #include "data_structure.hpp"
+#include "dataset_format.h"
+#include "lz4_block.h"
 #include "purchase_arch.hpp"
 
 using cuckoofilter::CuckooFilter;
 
+//what ingestion records for every row, the key is built from it later
+//row values always come in through fetch_rows
+struct RowRef{
+    uint32_t seed;
+    uint32_t slice;
+};
+
 class Key{
 public:
     Key(){}
 
-    Key(float* dptr, float*lptr, Model* model_link, int col, int slice_num){
-        dataPtr = dptr;
-        labelPtr = lptr;
+    Key(const RowRef& row, int row_index, Model* model_link, int col, uint64_t id){
+        index = row_index;
         modelPtr = model_link;
-        slice = slice_num;
+        slice = row.slice;
         len = (col+1)*sizeof(float);
-        // kid = hash(dataPtr);
-        float* temp = (float*)malloc((col+1)*sizeof(float*));
-        memcpy(temp, dataPtr, col*sizeof(float));
-        memcpy(temp+col, labelPtr, sizeof(float));
-        kid = XXHash64::hash(temp, len, 1); //here need set seed
+        kid = id; //from compute_kids
         tag = 1;
-        // seed = rand(); //here has problem, need set random seed
-        sgx_read_rand((unsigned char *)&seed, 4);
+        seed = row.seed;
     }
 
     uint64_t getKid(){
         return kid;
     }
 
-    float* getDataPtr(){
-        return dataPtr;
-    }
-
-    float* getLabelPtr(){
-        return labelPtr;
-    }
-
     void setTag(int num){
         tag = num;
     }
@@ -87,6 +86,10 @@ public:
         return slice;
     }
 
+    int getIndex(){
+        return index;
+    }
+
     int getTag(){
         return tag;
     }
@@ -95,32 +98,81 @@ public:
         return seed;
     }
 
+    void setDigest(uint64_t d){
+        digest = d;
+    }
+
+    uint64_t getDigest(){
+        return digest;
+    }
+
 private:
     uint64_t kid;
+    uint64_t digest; //xxsha256 at ingestion, the filter entry of this row
     uint64_t len;
     uint32_t tag;
     uint32_t seed;
     uint32_t slice;
-    float* dataPtr;
-    float* labelPtr;
+    uint32_t index; //position in rowList and in the live bitmap
     Model* modelPtr;
 };
 
+std::vector<RowRef> rowList;
 std::map<uint64_t, Key*> keyMap; //here do not know whether it is in the enclave and use enclave std lib
 std::vector<Key*> keyList;
 CuckooFilter<uint64_t, 8> filter(65536);
 
-int network[] = {1, 128, 1};
+//lazy mode: keyMap, keyList and filter are built in the background or on first use
+int lazy_index = 0;
+//re-hash every row a load pass fetches and compare it with the digest taken at ingestion
+int digest_check = 0;
+sgx_thread_mutex_t index_lock = SGX_THREAD_MUTEX_INITIALIZER;
+
+//layers after the input, see parse_layers, and the Model network they give for c features
+char arch_spec[256] = "128,tanh,1,sigmoid";
+vector<LayerSpec> layers;
+vector<int> network;
+//OpenMP workers used by DNNL, each one takes a TCS, keep this below TCSNum in Enclave.config.xml
+const int max_omp_threads = 56;
+//threads asked by ecall_set_threads, 0 keeps the runtime default. omp_set_num_threads only sets
+//the calling thread's ICV and every root ecall may run on another TCS, so apply_threads sets it
+//again at the start of each ecall running DNNL
+int dnnl_threads = 0;
+//optimizer for every slice, its state is part of each checkpoint
+int optimizer_kind = OPTIMIZER_SGD;
+float learning_rate = 0.01f;
+//bf16 primitives with fp32 master weights and fp32 checkpoints
+int bf16_training = 0;
+//threads splitting every batch for synchronous data parallel training, see MLP::set_workers
+int train_workers = 1;
+//Hogwild epochs on those workers, and the loss curve of every slice printed after its training
+int async_training = 0;
+int loss_report = 0;
+//rows per training step, 1000 unless ecall_tune_batch measured or unsealed a better one
+int train_batch_size = 1000;
 int slice_size = 10000;
 int model_num;
 std::vector<Model*> model_storage;
 vector<int> slice_start_index;
 int real_count = 0;
-vector<int> slice_state;
+//exact liveness of every row for internal scans, the filter only answers ecall_contains
+std::vector<uint64_t> live_bits;
 
 int r;
 int c;
 uint64_t eid;
+int fetch_chunk_rows = 256; //rows per fetch ocall, the buffer is staged on the untrusted stack
+
+//chunked dataset file attached by ecall_attach_dataset, its rows are verified chunk by chunk
+int dataset_attached = 0;
+dataset_header_t dataset;
+std::vector<dataset_chunk_t> dataset_chunks;
+const uint64_t max_chunk_bytes = 4 << 20; //uncompressed, ocall buffers live on the untrusted stack
+//chunk buffers sized for the largest stored and raw chunk at attach time, reused by every fetch
+std::vector<unsigned char> chunk_stored;
+std::vector<unsigned char> chunk_raw;
+sgx_thread_mutex_t chunk_lock = SGX_THREAD_MUTEX_INITIALIZER; //the lazy index build fetches in parallel
+const int kid_lanes = 8; //rows hashed together by XXHash64::hashBatch
 
 // float* enclave_data_storage;
 // float* enclave_label_storage;
@@ -147,44 +199,490 @@ void ecall_libcxx_functions(void){
     return;
 }
 
-uint64_t xxsha256(Key* key, int col, uint64_t enclave_id){
-    int hashStringBUfferLen = sizeof(float)*(col+1)+sizeof(uint64_t)+sizeof(uint64_t)+1;
-    char* hashStringBuffer = (char*)malloc(hashStringBUfferLen);
-    uint64_t kid = key->getKid();
-    memcpy(hashStringBuffer, &kid, sizeof(uint64_t));
-    memcpy(hashStringBuffer+sizeof(uint64_t), key->getDataPtr(), sizeof(float)*col);
-    memcpy(hashStringBuffer+sizeof(float)*col+sizeof(uint64_t), key->getLabelPtr(), sizeof(float));
-    memcpy(hashStringBuffer+sizeof(float)*(col+1)+sizeof(uint64_t), &enclave_id, sizeof(uint64_t));
-    hashStringBuffer[hashStringBUfferLen-1] = '\0';
-    
+//membership digest: XXHash64 of sha256(kid | row | label | enclave id | '\0'), fed in pieces so nothing is copied
+uint64_t xxsha256(uint64_t kid, const float* row, const float* label, int col, uint64_t enclave_id){
+    const char terminator = '\0';
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    SHA256_CTX sha256;
+    SHA256_Init(&sha256);
+    SHA256_Update(&sha256, &kid, sizeof(uint64_t));
+    SHA256_Update(&sha256, row, sizeof(float)*col);
+    SHA256_Update(&sha256, label, sizeof(float));
+    SHA256_Update(&sha256, &enclave_id, sizeof(uint64_t));
+    SHA256_Update(&sha256, &terminator, 1);
+    SHA256_Final(digest, &sha256);
+
     char hashBuffer[33];
-    
-    sha256_string(hashStringBuffer, hashStringBUfferLen, hashBuffer);
-    
+    memcpy(hashBuffer, digest, SHA256_DIGEST_LENGTH);
+    hashBuffer[32] = '\0';
+    return XXHash64::hash(hashBuffer, 33, 1);
+}
 
-    uint64_t result = XXHash64::hash(hashBuffer, 33, 1);
+//checkpoint digest over the weights, the optimizer state and step, and the shuffle seed
+void digestModel(Model* model, char* out){
+    size_t len = model->model_size+model->state_size+sizeof(int)+sizeof(uint32_t);
+    char* buffer = (char*)malloc(len);
+    char* p = buffer;
+    memcpy(p, model->storage, model->model_size);
+    p += model->model_size;
+    if(model->state_size > 0){
+        memcpy(p, model->state, model->state_size);
+        p += model->state_size;
+    }
+    memcpy(p, &model->step, sizeof(int));
+    p += sizeof(int);
+    memcpy(p, &model->seed, sizeof(uint32_t));
+    sha256_string(buffer, len, out);
+    free(buffer);
+}
 
-    free(hashStringBuffer);
+void hashModel(Model* model){
+    digestModel(model, model->hash);
+}
 
-    return result;
+//seed is the one of the first row of the slice the checkpoint was trained for
+int verifyModel(Model* model, uint32_t seed){
+    char temp[33];
+    digestModel(model, temp);
+    return model->seed != seed || memcmp(model->hash, temp, 32);
 }
 
-void hashModel(Model* model, Key* key){
-    char* buffer = (char*)malloc(model->model_size+sizeof(uint32_t));
-    memcpy(buffer, model->storage, model->model_size);
-    uint32_t seed = key->getSeed();
-    memcpy(buffer+model->model_size, &seed, sizeof(uint32_t));
-    sha256_string(buffer, model->model_size+sizeof(uint32_t), model->hash);
+int ecall_attach_dataset(dataset_header_t* header, dataset_chunk_t* chunks, size_t num, uint8_t* expected_root){
+    //the keys and checkpoints of the storage belong to the rows of the first dataset
+    if(!model_storage.empty()){
+        printf("a dataset can only be attached before the storage is initialized\n");
+        return -1;
+    }
+    if(header->magic != DATASET_MAGIC || header->version != DATASET_VERSION || header->dtype != DATASET_DTYPE_F32
+        || (header->codec != DATASET_CODEC_RAW && header->codec != DATASET_CODEC_LZ4)
+        || header->chunk_rows == 0 || num != header->num_chunks
+        || num != (header->rows + header->chunk_rows - 1) / header->chunk_rows
+        || (uint64_t)header->chunk_rows*(header->cols+1)*sizeof(float) > max_chunk_bytes){
+        printf("dataset header is not supported\n");
+        return -1;
+    }
+    //the root authenticates the chunk table, the table authenticates every chunk
+    unsigned char root[SHA256_DIGEST_LENGTH];
+    SHA256_CTX sha256;
+    SHA256_Init(&sha256);
+    uint64_t max_stored = 0;
+    for(size_t i=0; i<num; i++){
+        uint64_t raw_size = dataset_chunk_rows(header, i)*(header->cols+1)*sizeof(float);
+        if(header->codec == DATASET_CODEC_RAW ? chunks[i].size != raw_size : chunks[i].size > LZ4_BLOCK_BOUND(raw_size)){
+            printf("chunk %d has a wrong size\n", (int)i);
+            return -1;
+        }
+        max_stored = chunks[i].size > max_stored ? chunks[i].size : max_stored;
+        SHA256_Update(&sha256, chunks[i].hash, DATASET_HASH_LENGTH);
+    }
+    SHA256_Final(root, &sha256);
+    if(memcmp(root, header->root, DATASET_HASH_LENGTH) != 0
+        || (expected_root != NULL && memcmp(root, expected_root, DATASET_HASH_LENGTH) != 0)){
+        printf("dataset root does not match\n");
+        return -1;
+    }
+    dataset = *header;
+    dataset_chunks.assign(chunks, chunks+num);
+    chunk_stored.resize(max_stored);
+    chunk_raw.resize(header->codec == DATASET_CODEC_RAW ? 0 : (size_t)header->chunk_rows*(header->cols+1)*sizeof(float));
+    dataset_attached = 1;
+    fetch_chunk_rows = header->chunk_rows;
+    printf("dataset attached, %d chunks of %d rows, codec %d\n", (int)num, (int)header->chunk_rows, (int)header->codec);
+    return 0;
 }
 
-int verifyModel(Model* model, Key* key){
-    char temp[33];
-    char* buffer = (char*)malloc(model->model_size+sizeof(uint32_t));
-    memcpy(buffer, model->storage, model->model_size);
-    uint32_t seed = key->getSeed();
-    memcpy(buffer+model->model_size, &seed, sizeof(uint32_t));
-    sha256_string(buffer, model->model_size+sizeof(uint32_t), temp);
-    strcmp(model->hash, temp);
+//fetch chunk index into stored and check it against the chunk table, tampered data stops the enclave
+//returns the chunk rows and labels, lz4 chunks are decompressed into raw
+const float* fetch_chunk(uint64_t index, unsigned char* stored, unsigned char* raw){
+    const dataset_chunk_t& chunk = dataset_chunks[index];
+    ocall_fetch_chunk(index, stored, chunk.size);
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    SHA256_CTX sha256;
+    SHA256_Init(&sha256);
+    SHA256_Update(&sha256, stored, chunk.size);
+    SHA256_Final(hash, &sha256);
+    if(memcmp(hash, chunk.hash, DATASET_HASH_LENGTH) != 0){
+        printf("chunk %d does not match the dataset root\n", (int)index);
+        abort();
+    }
+    if(dataset.codec == DATASET_CODEC_RAW){
+        return (const float*)stored;
+    }
+    long raw_size = dataset_chunk_rows(&dataset, index)*(dataset.cols+1)*sizeof(float);
+    if(lz4_block::decompress(stored, chunk.size, raw, raw_size) != raw_size){
+        printf("chunk %d can not be decompressed\n", (int)index);
+        abort();
+    }
+    return (const float*)raw;
+}
+
+//rows of the attached dataset, chunk by chunk through the buffers of ecall_attach_dataset
+void fetch_dataset_rows(int start, int num, float* data_out, float* label_out){
+    sgx_thread_mutex_lock(&chunk_lock);
+    unsigned char* stored = chunk_stored.data();
+    unsigned char* raw = chunk_raw.data();
+    int i = start;
+    while(i < start+num){
+        uint64_t index = i/dataset.chunk_rows;
+        int first = index*dataset.chunk_rows;
+        int rows = dataset_chunk_rows(&dataset, index);
+        int from = i-first;
+        int n = rows-from<start+num-i?rows-from:start+num-i;
+        const float* chunk_data = fetch_chunk(index, stored, raw);
+        const float* chunk_label = chunk_data+(size_t)rows*c;
+        memcpy(data_out+(size_t)(i-start)*c, chunk_data+(size_t)from*c, (size_t)n*c*sizeof(float));
+        memcpy(label_out+(i-start), chunk_label+from, n*sizeof(float));
+        i += n;
+    }
+    sgx_thread_mutex_unlock(&chunk_lock);
+}
+
+//copy rows [start, start+num) from the untrusted row store, chunk by chunk
+void fetch_rows(int start, int num, float* data_out, float* label_out){
+    if(dataset_attached && start < dataset.rows){
+        int n = start+num<dataset.rows?num:dataset.rows-start;
+        fetch_dataset_rows(start, n, data_out, label_out);
+        start += n;
+        num -= n;
+        data_out += (size_t)n*c;
+        label_out += n;
+    }
+    //rows appended after the dataset are served from the App's row segments
+    for(int i=start; i<start+num; i+=fetch_chunk_rows){
+        int n = start+num<i+fetch_chunk_rows?start+num-i:fetch_chunk_rows;
+        ocall_fetch_rows(i, n, data_out+(size_t)(i-start)*c, (size_t)n*c, label_out+(i-start));
+    }
+}
+
+//kid of a row is the XXHash64 of its values followed by its label, rows are hashed kid_lanes at a time
+void compute_kids(const float* rows, const float* labels, int n, uint64_t* kids){
+    size_t len = (c+1)*sizeof(float);
+    float* stage = (float*)malloc(kid_lanes*len);
+    const void* lanes[kid_lanes];
+    for(int i=0; i<n; i+=kid_lanes){
+        int m = n-i<kid_lanes?n-i:kid_lanes;
+        for(int j=0; j<m; j++){
+            float* row = stage+(size_t)j*(c+1);
+            memcpy(row, rows+(size_t)(i+j)*c, c*sizeof(float));
+            row[c] = labels[i+j];
+            lanes[j] = row;
+        }
+        XXHash64::hashBatch(lanes, m, len, 1, kids+i); //here need set seed
+    }
+    free(stage);
+}
+
+//ingestion only records the rows and draws their seeds
+void record_rows(int n, int first_slice){
+    std::vector<uint32_t> seeds(n);
+    sgx_read_rand((unsigned char *)seeds.data(), n*sizeof(uint32_t));
+    sgx_thread_mutex_lock(&index_lock);
+    for(int i=0; i<n; i++){
+        RowRef ref = {seeds[i], (uint32_t)(first_slice+i/slice_size)};
+        rowList.push_back(ref);
+    }
+    live_bits.resize((rowList.size()+63)/64, 0);
+    for(int i=rowList.size()-n; i<rowList.size(); i++){
+        live_bits[i >> 6] |= 1ULL << (i & 63);
+    }
+    sgx_thread_mutex_unlock(&index_lock);
+}
+
+inline bool is_live(int row){
+    return (live_bits[row >> 6] >> (row & 63)) & 1;
+}
+
+//number of live rows in [start, end)
+int count_live(int start, int end){
+    int count = 0;
+    while(start < end){
+        int word = start >> 6;
+        int bit = start & 63;
+        int n = end-start<64-bit?end-start:64-bit;
+        uint64_t mask = n == 64 ? ~0ULL : ((1ULL << n)-1) << bit;
+        count += __builtin_popcountll(live_bits[word] & mask);
+        start += n;
+    }
+    return count;
+}
+
+int slice_live_rows(int slice){
+    int start = slice_start_index[slice];
+    int end = slice+1<slice_start_index.size()?slice_start_index[slice+1]:rowList.size();
+    return count_live(start, end);
+}
+
+//build keys and filter entries for the rows recorded since the last call
+void build_index(){
+    sgx_thread_mutex_lock(&index_lock);
+    int first = keyList.size();
+    int n = rowList.size()-first;
+    if(n > 0){
+        double start, end;
+        ocall_get_time(&start);
+        float* chunk_data = (float*)malloc((size_t)fetch_chunk_rows*c*sizeof(float));
+        float* chunk_label = (float*)malloc(fetch_chunk_rows*sizeof(float));
+        std::vector<uint64_t> kids(fetch_chunk_rows);
+        for(int i=first; i<rowList.size(); i+=fetch_chunk_rows){
+            int m = rowList.size()<i+fetch_chunk_rows?rowList.size()-i:fetch_chunk_rows;
+            fetch_rows(i, m, chunk_data, chunk_label);
+            compute_kids(chunk_data, chunk_label, m, kids.data());
+            for(int j=0; j<m; j++){
+                Key* key = new Key(rowList[i+j], i+j, model_storage[rowList[i+j].slice], c, kids[j]);
+                keyMap[key->getKid()] = key;
+                keyList.push_back(key);
+                key->setDigest(xxsha256(kids[j], chunk_data+(size_t)j*c, chunk_label+j, c, eid));
+                filter.Add(key->getDigest());
+            }
+        }
+        free(chunk_data);
+        free(chunk_label);
+        ocall_get_time(&end);
+        printf("Index build time for %d rows is %.8f ms\n", n, end-start);
+    }
+    sgx_thread_mutex_unlock(&index_lock);
+}
+
+void ecall_set_lazy_index(int enable){
+    lazy_index = enable;
+}
+
+void ecall_set_digest_check(int enable){
+    digest_check = enable;
+}
+
+void apply_threads(){
+    if(dnnl_threads > 0){
+        omp_set_num_threads(dnnl_threads);
+    }
+}
+
+void ecall_set_threads(int num){
+    if(num < 1){
+        num = 1;
+    }
+    if(num > max_omp_threads){
+        printf("%d threads asked, the enclave has TCS for %d\n", num, max_omp_threads);
+        num = max_omp_threads;
+    }
+    dnnl_threads = num;
+    apply_threads();
+    printf("DNNL runs on %d threads\n", omp_get_max_threads());
+}
+
+//n random binary rows with about 1/16 of the features set and random labels, for benchmarks
+void random_rows(int n, float* data, float* label){
+    unsigned char* bits = (unsigned char*)malloc((size_t)n*c);
+    sgx_read_rand(bits, (size_t)n*c);
+    for(size_t i=0; i<(size_t)n*c; i++){
+        data[i] = bits[i] < 16 ? 1.0f : 0.0f;
+    }
+    for(int i=0; i<n; i++){
+        label[i] = bits[i] & 1;
+    }
+    free(bits);
+}
+
+//training samples/sec of one full batch step at 1..max_threads threads, on random binary rows
+void ecall_thread_scaling(int max_threads, int steps){
+    const int batch = train_batch_size;
+    if(model_storage.empty()){
+        printf("thread scaling needs the enclave storage initialized\n");
+        return;
+    }
+    apply_threads();
+    int old_threads = omp_get_max_threads();
+    float* data = (float*)malloc((size_t)batch*c*sizeof(float));
+    float* label = (float*)malloc(batch*sizeof(float));
+    random_rows(batch, data, label);
+    MLP bench(layers, c, learning_rate, batch);
+    bench.set_optimizer(optimizer_kind, learning_rate);
+    bench.set_precision(bf16_training);
+    bench.setModel(model_storage[0]);
+    printf("threads, samples/sec\n");
+    for(int t=1; t<=max_threads && t<=max_omp_threads; t++){
+        omp_set_num_threads(t);
+        bench.train_batch(data, label, batch); //warm up the OpenMP team
+        double start, end;
+        ocall_get_time(&start);
+        for(int i=0; i<steps; i++){
+            bench.train_batch(data, label, batch);
+        }
+        ocall_get_time(&end);
+        printf("%d, %.1f\n", t, (double)steps*batch/((end-start)/1e6));
+    }
+    //the same step split over t data parallel workers with one DNNL thread each
+    printf("workers, samples/sec\n");
+    omp_set_num_threads(1);
+    for(int t=1; t<=max_threads && t<=max_omp_threads; t++){
+        bench.set_workers(t);
+        bench.train_batch(data, label, batch);
+        double start, end;
+        ocall_get_time(&start);
+        for(int i=0; i<steps; i++){
+            bench.train_batch(data, label, batch);
+        }
+        ocall_get_time(&end);
+        printf("%d, %.1f\n", t, (double)steps*batch/((end-start)/1e6));
+    }
+    bench.set_workers(1);
+    omp_set_num_threads(old_threads);
+    free(data);
+    free(label);
+}
+
+//batch sizes the tuner may pick, the larger ones are still small against a slice of 10000 rows
+const int tune_batches[] = {128, 256, 512, 1000, 2000};
+const int tune_rows = 20000; //rows timed per candidate
+
+//time training steps at every candidate batch size with the current model, precision and
+//workers. the smallest size within 5% of the best throughput wins: smaller batches make more
+//updates per epoch, so they are the safer choice for accuracy when the speed is about the same
+int calibrate_batch(){
+    const int num = sizeof(tune_batches)/sizeof(int);
+    const int max_batch = tune_batches[num-1];
+    float* data = (float*)malloc((size_t)max_batch*c*sizeof(float));
+    float* label = (float*)malloc(max_batch*sizeof(float));
+    random_rows(max_batch, data, label);
+    double rate[num];
+    double best = 0;
+    printf("batch, samples/sec\n");
+    for(int i=0; i<num; i++){
+        int b = tune_batches[i];
+        MLP bench(layers, c, learning_rate, b);
+        bench.set_optimizer(optimizer_kind, learning_rate);
+        bench.set_precision(bf16_training);
+        bench.set_workers(train_workers);
+        bench.setModel(model_storage[0]);
+        bench.train_batch(data, label, b);
+        int steps = tune_rows/b > 3 ? tune_rows/b : 3;
+        double start, end;
+        ocall_get_time(&start);
+        for(int j=0; j<steps; j++){
+            bench.train_batch(data, label, b);
+        }
+        ocall_get_time(&end);
+        rate[i] = (double)steps*b/((end-start)/1e6);
+        best = rate[i] > best ? rate[i] : best;
+        printf("%d, %.1f\n", b, rate[i]);
+    }
+    free(data);
+    free(label);
+    for(int i=0; i<num; i++){
+        if(rate[i] >= 0.95*best){
+            return tune_batches[i];
+        }
+    }
+    return train_batch_size;
+}
+
+//everything the measured throughput depends on, sealed as MAC text next to the result
+int tune_key(char* key, size_t len){
+    return snprintf(key, len, "tune v1 cols=%d arch=%s bf16=%d workers=%d threads=%d optimizer=%d",
+        c, arch_spec, bf16_training, train_workers, omp_get_max_threads(), optimizer_kind);
+}
+
+//use the batch size sealed by an earlier run when it was measured for the same setup, else
+//calibrate and seal the result into out for the App to cache. the seal key is bound to the CPU
+//and the enclave signer, so a config from another host never unseals and is measured again
+int ecall_tune_batch(uint8_t* sealed, uint32_t sealed_len, uint8_t* out, uint32_t out_cap, uint32_t* out_len){
+    apply_threads();
+    *out_len = 0;
+    if(model_storage.empty() || mlp != NULL){
+        printf("batch tuning needs the enclave storage initialized and runs before training\n");
+        return -1;
+    }
+    char key[512];
+    int key_len = tune_key(key, sizeof(key));
+    if(sealed != NULL && sealed_len >= sizeof(sgx_sealed_data_t)
+        && sgx_get_add_mac_txt_len((sgx_sealed_data_t*)sealed) == (uint32_t)key_len
+        && sgx_get_encrypt_txt_len((sgx_sealed_data_t*)sealed) == sizeof(int)
+        && sgx_calc_sealed_data_size(key_len, sizeof(int)) == sealed_len){
+        char stored[512];
+        uint32_t stored_len = sizeof(stored);
+        int batch = 0;
+        uint32_t batch_len = sizeof(int);
+        if(sgx_unseal_data((sgx_sealed_data_t*)sealed, (uint8_t*)stored, &stored_len, (uint8_t*)&batch, &batch_len) == SGX_SUCCESS
+            && stored_len == (uint32_t)key_len && memcmp(stored, key, key_len) == 0 && batch > 0){
+            train_batch_size = batch;
+            printf("batch size %d from the sealed config\n", batch);
+            return 0;
+        }
+    }
+    train_batch_size = calibrate_batch();
+    printf("batch size %d calibrated\n", train_batch_size);
+    uint32_t size = sgx_calc_sealed_data_size(key_len, sizeof(int));
+    if(size != UINT32_MAX && size <= out_cap
+        && sgx_seal_data(key_len, (uint8_t*)key, sizeof(int), (uint8_t*)&train_batch_size, size, (sgx_sealed_data_t*)out) == SGX_SUCCESS){
+        *out_len = size;
+    }
+    return 0;
+}
+
+//the checkpoints are sized for the optimizer state, so it is fixed once the storage exists
+void ecall_set_optimizer(int kind, float lr){
+    if(kind < OPTIMIZER_SGD || kind > OPTIMIZER_ADAM || !model_storage.empty()){
+        printf("optimizer can only be set to 0, 1 or 2 before the storage is initialized\n");
+        return;
+    }
+    optimizer_kind = kind;
+    learning_rate = lr;
+}
+
+void ecall_set_workers(int num){
+    if(mlp != NULL || num < 1 || num > max_omp_threads){
+        printf("workers can only be set to 1..%d before training\n", max_omp_threads);
+        return;
+    }
+    train_workers = num;
+}
+
+void ecall_set_async(int enable){
+    if(mlp != NULL){
+        printf("async training can only be set before training\n");
+        return;
+    }
+    async_training = enable;
+}
+
+void ecall_set_loss_report(int enable){
+    loss_report = enable;
+}
+
+//mean training loss per epoch of the slice just trained
+void print_losses(int slice){
+    if(!loss_report){
+        return;
+    }
+    const vector<float>& losses = mlp->losses();
+    char line[1024];
+    int len = snprintf(line, sizeof(line), "slice %d loss:", slice);
+    for(size_t i=0; i<losses.size() && len < (int)sizeof(line)-16; i++){
+        len += snprintf(line+len, sizeof(line)-len, " %.5f", losses[i]);
+    }
+    printf("%s\n", line);
+}
+
+void ecall_set_precision(int bf16){
+    if(mlp != NULL){
+        printf("precision can only be set before training\n");
+        return;
+    }
+    bf16_training = bf16;
+}
+
+//the layer list is fixed once the checkpoints are sized
+void ecall_set_arch(const char* spec){
+    vector<LayerSpec> parsed;
+    if(!model_storage.empty() || strlen(spec) >= sizeof(arch_spec) || parse_layers(spec, parsed) != 0){
+        printf("arch %s rejected, it is a list like 128,tanh,1,sigmoid or 128,tanh,100,softmax given before the storage is initialized\n", spec);
+        return;
+    }
+    strncpy(arch_spec, spec, sizeof(arch_spec));
+}
+
+void ecall_build_index(){
+    build_index();
 }
 
 void test_filter(){
@@ -212,78 +710,175 @@ void test_filter(){
     printf("Total delete time for %d is %.8f ms and each need %.8f ms\n", r, end-start, (end-start)/r);
 }
 
-void ecall_init_enclave_storage(float* input_data, float* input_label, int row, int col, uint64_t enclave_id){
+//rows are served by ocall_fetch_rows or, with an attached dataset, by ocall_fetch_chunk
+//row and col come from the App, with an attached dataset they have to be the ones of its header
+//because fetch_dataset_rows lays the verified chunks out with c
+//Glorot uniform weights and zero biases in the plain checkpoint layout, drawn with splitmix64 from
+//seed, so the initial model is random (a constant one gives every hidden unit the same gradient)
+//and can be redrawn from the seed it records
+void init_model(Model* model, uint32_t seed){
+    uint64_t state = seed;
+    float* p = model->storage;
+    for(size_t k=0; k+1<network.size(); k++){
+        float limit = sqrtf(6.0f/(network[k]+network[k+1]));
+        for(size_t j=0; j<(size_t)network[k]*network[k+1]; j++){
+            uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+            z ^= z >> 31;
+            *p++ = ((z >> 40)*(2.0f/16777216.0f)-1.0f)*limit;
+        }
+        memset(p, 0, network[k+1]*sizeof(float));
+        p += network[k+1];
+    }
+    model->seed = seed;
+    model->step = 0;
+}
+
+int ecall_init_enclave_storage(int row, int col, uint64_t enclave_id){
+    if(!model_storage.empty() || row <= 0 || col <= 0
+        || (dataset_attached && (dataset.rows > INT_MAX || (uint64_t)row != dataset.rows || (uint32_t)col != dataset.cols))){
+        printf("storage of (%d, %d) rejected, it does not match the attached dataset\n", row, col);
+        return -1;
+    }
     r = row;
     c = col;
     eid = enclave_id;
     real_count = r;
 
     // define the nework parameter
-    network[0] = col;
-    model_num = (row % slice_size + row) / slice_size;
+    parse_layers(arch_spec, layers);
+    network.assign(1, col);
+    for(size_t i=0; i<layers.size(); i++){
+        if(layers[i].units > 0){
+            network.push_back(layers[i].units);
+        }
+    }
+    model_num = (row + slice_size - 1) / slice_size;
     
     //initialize the model storage
     for(int i=0; i<model_num+1; i++){
         Model* temp;
-        ocall_init_model_storage((void**)&temp, network, 3);
+        ocall_init_model_storage((void**)&temp, network.data(), network.size(), optimizer_state_count(optimizer_kind));
         model_storage.push_back(temp);
     }
 
-    // sgx_read_rand((unsigned char *)(model_storage[0]->storage), model_storage[0]->model_size);
-    for(int i=0; i<model_storage[0]->model_size; i++){
-        model_storage[0]->storage[i] = 0.01f;
-    }
-
-    //initialize the key list
-    for(int i=0; i < row; i++){
-        Key* key = new Key(input_data+(col*i), input_label+i, model_storage[i/slice_size], col, i/slice_size);
-        // printf("%f\n", input[i][0]);
-        // printf("%f\n", key->getDataPtr()[0]);
-        keyMap[key->getKid()] = key;
-        keyList.push_back(key);
-        uint64_t hash = xxsha256(key, col, enclave_id);
+    //checkpoint 0 is drawn from a fresh seed, recorded and hashed like the seeds of the slices
+    uint32_t seed;
+    sgx_read_rand((unsigned char *)&seed, sizeof(seed));
+    init_model(model_storage[0], seed);
+    hashModel(model_storage[0]);
 
-        filter.Add(hash);
-        // printf("%d", filter.Contain(hash) == cuckoofilter::Ok);
+    //record the rows, the key list is built now or on first use in lazy mode
+    record_rows(row, 0);
+    if(lazy_index){
+        return 0;
     }
+    build_index();
     // printf("fisrt kid is %ld\n",keyList[0]->getKid());
     printf("filter size is %d bytes\n", filter.SizeInBytes());
     test_filter();
+    return 0;
 }
 
-void ecall_training(){
-    //load whole data
-    float* enclave_data_storage = (float*)malloc(r*c*sizeof(float));
-    float* enclave_label_storage = (float*)malloc(r*sizeof(float));
+//load all live rows in storage order, return the number of rows loaded. a row failing the digest
+//re-check is dropped like an unlearned one, so the live counts of the slices match what was loaded
+int load_live_rows(float* data_out, float* label_out){
+    float* chunk_data = (float*)malloc((size_t)fetch_chunk_rows*c*sizeof(float));
+    float* chunk_label = (float*)malloc(fetch_chunk_rows*sizeof(float));
     int count = 0;
-    double start, end;
-    ocall_get_time(&start);
-    for(int i=0; i<keyList.size(); i+=1){
-        Key* key = keyList[i];
-        uint64_t hash = xxsha256(key, c, eid);
-        if(filter.Contain(hash) == cuckoofilter::Ok){
-            memcpy(enclave_data_storage+i*c, key->getDataPtr(), c*sizeof(float));
-            memcpy(enclave_label_storage+i, key->getLabelPtr(), sizeof(float));
+    //liveness comes from the bitmap, the keys are only needed to re-check digests
+    if(digest_check){
+        build_index();
+    }
+    for(int i=0; i<rowList.size(); i+=fetch_chunk_rows){
+        int n = rowList.size()<i+fetch_chunk_rows?rowList.size()-i:fetch_chunk_rows;
+        fetch_rows(i, n, chunk_data, chunk_label);
+        if(!digest_check && count_live(i, i+n) == n){
+            memcpy(data_out+(size_t)count*c, chunk_data, (size_t)n*c*sizeof(float));
+            memcpy(label_out+count, chunk_label, n*sizeof(float));
+            count += n;
+            continue;
+        }
+        for(int j=0; j<n; j++){
+            if(!is_live(i+j)){
+                continue;
+            }
+            if(digest_check){
+                Key* key = keyList[i+j];
+                if(xxsha256(key->getKid(), chunk_data+(size_t)j*c, chunk_label+j, c, eid) != key->getDigest()){
+                    printf("row %d does not match its digest, dropped\n", i+j);
+                    sgx_thread_mutex_lock(&index_lock);
+                    filter.Delete(key->getDigest());
+                    key->setTag(0);
+                    live_bits[(i+j) >> 6] &= ~(1ULL << ((i+j) & 63));
+                    real_count--;
+                    sgx_thread_mutex_unlock(&index_lock);
+                    continue;
+                }
+            }
+            memcpy(data_out+(size_t)count*c, chunk_data+(size_t)j*c, c*sizeof(float));
+            label_out[count] = chunk_label[j];
             count++;
         }
     }
+    free(chunk_data);
+    free(chunk_label);
+    return count;
+}
+
+//all live rows are loaded into the enclave heap at once, NULL when they do not fit. called before
+//an ecall changes any state, so a failed allocation leaves rows, keys and checkpoints as they were
+int alloc_rows(int rows, float** data_out, float** label_out){
+    *data_out = (float*)malloc((size_t)rows*c*sizeof(float));
+    *label_out = (float*)malloc(rows*sizeof(float));
+    if(*data_out == NULL || *label_out == NULL){
+        printf("%d rows need %d MB, more than the enclave heap has left\n", rows, (int)(((size_t)rows*(c+1)*sizeof(float)) >> 20));
+        free(*data_out);
+        free(*label_out);
+        return -1;
+    }
+    return 0;
+}
+
+void ecall_training(){
+    apply_threads();
+    if(model_storage.empty()){
+        printf("training needs the enclave storage initialized\n");
+        return;
+    }
+    //load whole data
+    float* enclave_data_storage;
+    float* enclave_label_storage;
+    if(alloc_rows(r, &enclave_data_storage, &enclave_label_storage) != 0){
+        return;
+    }
+    double start, end;
+    ocall_get_time(&start);
+    int count = load_live_rows(enclave_data_storage, enclave_label_storage);
     ocall_get_time(&end);
     printf("Total data load time for %d is %.8f ms and each need %.8f ms\n", r, end-start, (end-start)/r);
     printf("loaded data count is %d\n", count);
 
-    mlp = new MLP(network, 0.01f, 1000);
+    mlp = new MLP(layers, c, learning_rate, train_batch_size);
+    mlp->set_optimizer(optimizer_kind, learning_rate);
+    mlp->set_precision(bf16_training);
+    mlp->set_workers(train_workers);
+    mlp->set_async(async_training);
     mlp->setModel(model_storage[0]);
-    for(int i=0; i<keyList.size(); i+=slice_size){
-        int size = keyList.size()<i+slice_size?keyList.size():i+slice_size;
-        int current_slice_size = keyList.size()<i+slice_size?keyList.size()%slice_size:slice_size;
+    int size = 0;
+    for(int i=0; i<rowList.size(); i+=slice_size){
+        //the live rows of the slices so far, rows dropped by the digest re-check are not loaded
+        size += count_live(i, rowList.size()<i+slice_size?rowList.size():i+slice_size);
         slice_start_index.push_back(i);
         // printf("size is %d\n", size);
-        slice_state.push_back(current_slice_size);
-        // printf("current slice size is %d\n", slice_state.back());
+        //the seed of the slice's first row shuffles its epochs and goes into the checkpoint
+        model_storage[i/slice_size+1]->seed = rowList[i].seed;
         mlp->train(enclave_data_storage, enclave_label_storage, 22, size, model_storage[i/slice_size+1]);
+        print_losses(i/slice_size+1);
         ocall_get_time(&start);
         mlp->saveModel(model_storage[i/slice_size+1]);
-        hashModel(model_storage[i/slice_size+1], keyList[i]);
+        hashModel(model_storage[i/slice_size+1]);
         ocall_get_time(&end);
         printf("Save time for model %d is %.8f ms\n", i/slice_size+1, end-start);
         // printf("%f\n", *(model_storage[0]->fc1w+1));
@@ -310,12 +905,77 @@ void ecall_training(){
     //     net_training_f32(network, keyMap.find(keyList[i])->second->getDataPtr(), keyMap.find(keyList[i])->second->getLabelPtr(), model_storage[i/slice_size], model_storage[i/slice_size+1], batch);
     // }
     
-    //don't know why here free not work
-    // free(enclave_data_storage);
-    // free(enclave_label_storage);
+    //train copies its batches, nothing keeps the rows
+    free(enclave_data_storage);
+    free(enclave_label_storage);
+}
+
+//new rows always open new tail slices, so every existing checkpoint stays valid
+void ecall_append_rows(int n){
+    apply_threads();
+    if(n <= 0 || mlp == NULL){
+        printf("append needs a trained model and at least one row\n");
+        return;
+    }
+    float* data_storage;
+    float* label_storage;
+    if(alloc_rows(r+n, &data_storage, &label_storage) != 0){
+        return;
+    }
+    int first_row = rowList.size();
+    int first_slice = slice_start_index.size();
+    int new_slices = (n + slice_size - 1) / slice_size;
+
+    sgx_thread_mutex_lock(&index_lock); //a background index build reads model_storage
+    for(int i=0; i<new_slices; i++){
+        Model* temp;
+        ocall_init_model_storage((void**)&temp, network.data(), network.size(), optimizer_state_count(optimizer_kind));
+        model_storage.push_back(temp);
+    }
+    sgx_thread_mutex_unlock(&index_lock);
+    record_rows(n, first_slice);
+    if(!lazy_index){
+        build_index();
+    }
+    r += n;
+    real_count += n;
+
+    int count = load_live_rows(data_storage, label_storage);
+    printf("loaded data count is %d\n", count);
+
+    //continue from the current last checkpoint, history is not retrained
+    mlp->setModel(model_storage[first_slice]);
+    int size = 0;
+    for(int i=0; i<first_slice; i++){
+        size += slice_live_rows(i);
+    }
+    for(int i=0; i<new_slices; i++){
+        int start = first_row + i*slice_size;
+        int current_slice_size = n-i*slice_size<slice_size?n-i*slice_size:slice_size;
+        slice_start_index.push_back(start);
+        size += count_live(start, start+current_slice_size);
+        model_storage[first_slice+i+1]->seed = rowList[start].seed;
+        mlp->train(data_storage, label_storage, 22, size, model_storage[first_slice+i+1]);
+        print_losses(first_slice+i+1);
+        mlp->saveModel(model_storage[first_slice+i+1]);
+        hashModel(model_storage[first_slice+i+1]);
+        printf("Save model %d\n", first_slice+i+1);
+    }
+    free(data_storage);
+    free(label_storage);
+}
+
+void ecall_contains(uint64_t kid, int* present){
+    build_index();
+    *present = 0;
+    std::map<uint64_t, Key*>::iterator it = keyMap.find(kid);
+    if(it != keyMap.end() && filter.Contain(it->second->getDigest()) == cuckoofilter::Ok){
+        *present = 1;
+    }
 }
 
 void ecall_predict(float* data, float* label, int size){
+    apply_threads();
     // mlp->setModel(model_storage[5]);
     int correct = 0;
     for(int i=0; i<size; i+=1000){
@@ -331,34 +991,27 @@ void ecall_predict(float* data, float* label, int size){
         }
     }
     printf("correct is %d\n", correct);
-    printf("accuracy is %f\n", ((double)correct)/size);
+    printf("accuracy is %f (%s training)\n", ((double)correct)/size, bf16_training ? "bf16" : "fp32");
 }
 
 void ecall_unlearning(uint64_t kid){
+    apply_threads();
+    build_index();
     if(keyMap.find(kid) != keyMap.end()){
         Key* temp = keyMap.find(kid)->second;
-        uint64_t hash = xxsha256(temp, c, eid);
-        if(filter.Contain(hash) == cuckoofilter::Ok){
-            filter.Delete(hash);
+        if(is_live(temp->getIndex())){
+            float* data_storage;
+            float* label_storage;
+            if(alloc_rows(r, &data_storage, &label_storage) != 0){
+                return;
+            }
+            filter.Delete(temp->getDigest());
             temp->setTag(0);
-            slice_state[temp->getSliceNum()]--;
+            live_bits[temp->getIndex() >> 6] &= ~(1ULL << (temp->getIndex() & 63));
             real_count--;
 
             //reload data
-            float* data_storage = (float*)malloc(r*c*sizeof(float));
-            float* label_storage = (float*)malloc(r*sizeof(float)); //don't know why exceed the length
-            int count = 0;
-            for(int i=0; i<keyList.size(); i+=1){
-                Key* key = keyList[i];
-                if(key->getKid() != temp->getKid() && key->getTag() != 0){
-                    uint64_t hash = xxsha256(key, c, eid);
-                    if(filter.Contain(hash) == cuckoofilter::Ok){
-                        memcpy(data_storage+count*c, key->getDataPtr(), c*sizeof(float));
-                        memcpy(label_storage+count, key->getLabelPtr(), sizeof(float));
-                        count++;
-                    }
-                }
-            }
+            int count = load_live_rows(data_storage, label_storage);
             printf("loaded data count is %d\n", count);
             // printf("label storage is %f\n", *(enclave_label_storage+count-1));
 
@@ -368,24 +1021,29 @@ void ecall_unlearning(uint64_t kid){
             double start, end;
             ocall_get_time(&start);
             if(startSlice>0){
-                if(verifyModel(model_storage[startSlice], keyList[slice_start_index[startSlice-1]]) == 0){
+                if(verifyModel(model_storage[startSlice], rowList[slice_start_index[startSlice-1]].seed) == 0){
                     printf("verifyed\n");
                 }
+            }else if(verifyModel(model_storage[0], model_storage[0]->seed) == 0){
+                printf("verifyed\n");
             }
             mlp->setModel(model_storage[startSlice]);
             ocall_get_time(&end);
             printf("Model load time for %d is %.8f ms\n", startSlice, end-start);
             int size = 0;
-            for(int i=0; i<slice_state.size(); i++){
-                size+=slice_state[i];
+            for(int i=0; i<slice_start_index.size(); i++){
+                size+=slice_live_rows(i);
                 if(i>=startSlice){
+                    model_storage[i+1]->seed = rowList[slice_start_index[i]].seed;
                     mlp->train(data_storage, label_storage, 22, size, model_storage[i+1]);
+                    print_losses(i+1);
                     mlp->saveModel(model_storage[i+1]);
-                    hashModel(model_storage[i+1], keyList[slice_start_index[i]]);
+                    hashModel(model_storage[i+1]);
                     printf("Save model %d\n", i+1);
                 }
             }
-            
+            free(data_storage);
+            free(label_storage);
         }
 
     }
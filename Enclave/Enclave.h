@@ -41,6 +41,10 @@ extern "C" {
 
 void printf(const char *fmt, ...);
 int net_training_f32(int network[], float* data, float* label, float* input_weights, float* result_weights, int batch);
+/* OpenMP runtime of sgx_omp, the SDK ships no omp.h */
+void omp_set_num_threads(int num);
+int omp_get_max_threads(void);
+size_t allocation_count(void); //malloc family calls so far (operator new included), always 0 unless built with SGX_ALLOC_COUNT=1
 
 #if defined(__cplusplus)
 }
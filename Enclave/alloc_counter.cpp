@@ -0,0 +1,59 @@
+#include <stdlib.h>
+
+#include "Enclave.h"
+
+//built with SGX_ALLOC_COUNT=1 the enclave is linked with -Wl,--wrap for the malloc family, so
+//every heap allocation of the enclave code, the C++ runtime (operator new), DNNL and sgx_omp
+//is counted here; MLP::train then reports how many heap allocations each training step made
+#ifdef ALLOC_COUNT
+
+static volatile size_t alloc_count = 0;
+
+extern "C" {
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t num, size_t size);
+void* __real_realloc(void* p, size_t size);
+//weak, so the enclave still links against a tlibc without one of them
+void* __real_memalign(size_t align, size_t size) __attribute__((weak));
+int __real_posix_memalign(void** p, size_t align, size_t size) __attribute__((weak));
+
+void* __wrap_malloc(size_t size){
+    __sync_fetch_and_add(&alloc_count, 1);
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t num, size_t size){
+    __sync_fetch_and_add(&alloc_count, 1);
+    return __real_calloc(num, size);
+}
+
+//a realloc may move the block, it counts as an allocation
+void* __wrap_realloc(void* p, size_t size){
+    __sync_fetch_and_add(&alloc_count, 1);
+    return __real_realloc(p, size);
+}
+
+void* __wrap_memalign(size_t align, size_t size){
+    __sync_fetch_and_add(&alloc_count, 1);
+    return __real_memalign(align, size);
+}
+
+int __wrap_posix_memalign(void** p, size_t align, size_t size){
+    __sync_fetch_and_add(&alloc_count, 1);
+    return __real_posix_memalign(p, align, size);
+}
+
+}
+
+size_t allocation_count(void){
+    return alloc_count;
+}
+
+#else
+
+size_t allocation_count(void){
+    return 0;
+}
+
+#endif
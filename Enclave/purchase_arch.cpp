@@ -3,8 +3,12 @@
 #include <chrono>
 #include <numeric>
 #include <vector>
+#include <map>
 #include <unordered_map>
 
+#include <pthread.h>
+#include <sgx_thread.h>
+
 #include "example_utils.hpp"
 #include "Enclave.h"
 #include "purchase_arch.hpp"
@@ -15,486 +19,1095 @@ using namespace std;
 using tag = memory::format_tag;
 using dt = memory::data_type;
 
-MLP::MLP(int arch[3], float a, int b){
+//64 byte aligned float arena, raw keeps the pointer to free
+static float* alloc_arena(size_t count, float** raw){
+    *raw = (float*)malloc(count*sizeof(float)+64);
+    return (float*)(((uintptr_t)*raw+63) & ~(uintptr_t)63);
+}
+
+//parse a layer list like "128,tanh,1,sigmoid", see purchase_arch.hpp
+int parse_layers(const char* spec, vector<LayerSpec>& layers){
+    layers.clear();
+    const char* p = spec;
+    while(*p){
+        const char* end = strchr(p, ',');
+        size_t len = end == NULL ? strlen(p) : end-p;
+        LayerSpec l = {0, algorithm::undef, false};
+        if(len > 0 && p[0] >= '0' && p[0] <= '9'){
+            //only digits, so 12x or 1e3 are rejected, and at most 9 of them so atoi cannot overflow
+            if(len > 9){
+                return -1;
+            }
+            for(size_t i=0; i<len; i++){
+                if(p[i] < '0' || p[i] > '9'){
+                    return -1;
+                }
+            }
+            l.units = atoi(p);
+            if(l.units <= 0){
+                return -1;
+            }
+        }else if(len == 4 && strncmp(p, "relu", 4) == 0){
+            l.activation = algorithm::eltwise_relu;
+        }else if(len == 4 && strncmp(p, "tanh", 4) == 0){
+            l.activation = algorithm::eltwise_tanh;
+        }else if((len == 7 && strncmp(p, "sigmoid", 7) == 0) || (len == 8 && strncmp(p, "logistic", 8) == 0)){
+            l.activation = algorithm::eltwise_logistic;
+        }else if(len == 7 && strncmp(p, "softmax", 7) == 0){
+            l.softmax = true;
+        }else{
+            return -1;
+        }
+        //an activation follows an inner product, never the input or another activation
+        if(l.units == 0 && (layers.empty() || layers.back().units == 0)){
+            return -1;
+        }
+        layers.push_back(l);
+        p += len;
+        if(*p == ','){
+            p++;
+        }
+    }
+    //the loss is binary cross entropy on a single sigmoid output or cross entropy on a softmax
+    //over at least two classes, softmax is only allowed as that output
+    size_t n = layers.size();
+    if(n < 2){
+        return -1;
+    }
+    for(size_t i=0; i+1<n; i++){
+        if(layers[i].softmax){
+            return -1;
+        }
+    }
+    bool binary = layers[n-2].units == 1 && layers[n-1].activation == algorithm::eltwise_logistic;
+    bool classes = layers[n-2].units >= 2 && layers[n-1].softmax;
+    return binary || classes ? 0 : -1;
+}
+
+//the form of an activation whose backward reads its output instead of its input
+static algorithm use_dst_for_bwd(algorithm a){
+    if(a == algorithm::eltwise_relu){
+        return algorithm::eltwise_relu_use_dst_for_bwd;
+    }else if(a == algorithm::eltwise_tanh){
+        return algorithm::eltwise_tanh_use_dst_for_bwd;
+    }
+    return algorithm::eltwise_logistic_use_dst_for_bwd;
+}
+
+MLP::MLP(const vector<LayerSpec>& l, int input_dim, float a, int b){
     eng = engine(parse_engine_kind(1, NULL), 0);
     s = stream(eng);
-    memcpy(network, arch, 3*sizeof(int));
-    alpha = a;
+    layers = l;
+    OptimizerConfig sgd = {OPTIMIZER_SGD, a, 0.9f, 0.9f, 0.999f, 1e-8f};
+    opt = sgd;
+    state = NULL;
+    state_raw = NULL;
+    steps = 0;
     batch = b;
-    // printf("alpha is %f\n", alpha);
-
-    // const memory::dim batch = b;
-    const memory::dim feature_num = network[0];
-    const memory::dim fc1_node_num = network[1];
-
-    // fc1 inner product {batch, feature_num} (x) {1000, feature_num}-> {batch, 1000}
-    memory::dims fc1_src_tz = {batch, feature_num};
-    memory::dims fc1_weights_tz = {fc1_node_num, feature_num};
-    memory::dims fc1_bias_tz = {fc1_node_num};
-    memory::dims fc1_dst_tz = {batch, fc1_node_num};
-
-    /// Allocate buffers for input and output data, weights, and bias.
-    /// @snippet cnn_inference_f32.cpp Allocate buffers
-    //[Allocate buffers]
-    user_src = vector<float>(batch * feature_num); //batch * feature_num
-    user_dst = vector<float>(batch * network[2]);
-    //[Allocate buffers]
-
-    user_src_memory = memory({{fc1_src_tz}, dt::f32, tag::nc}, eng);
-
-    fc1_weights = vector<float>(product(fc1_weights_tz));
-    fc1_bias = vector<float>(product(fc1_bias_tz));
-
-    fc1_user_weights_memory
-            = memory({{fc1_weights_tz}, dt::f32, tag::nc}, eng);
-    fc1_user_bias_memory = memory({{fc1_bias_tz}, dt::f32, tag::x}, eng);
-
-    // create memory descriptors for fc2olution data w/ no specified format
-    auto fc1_src_md = memory::desc({fc1_src_tz}, dt::f32, tag::any);
-    auto fc1_bias_md = memory::desc({fc1_bias_tz}, dt::f32, tag::any);
-    auto fc1_weights_md = memory::desc({fc1_weights_tz}, dt::f32, tag::any);
-    auto fc1_dst_md = memory::desc({fc1_dst_tz}, dt::f32, tag::any);
-
-    // create a inner_product
-    auto fc1_desc = inner_product_forward::desc(prop_kind::forward_inference,
-            fc1_src_md, fc1_weights_md, fc1_bias_md, fc1_dst_md);
-    auto fc1_prim_desc = inner_product_forward::primitive_desc(fc1_desc, eng);
-
-
-    auto fc1_src_memory = user_src_memory;
-    auto fc1_weights_memory = fc1_user_weights_memory;
-    // if (fc1_prim_desc.weights_desc() != fc1_user_weights_memory.get_desc()) {
-    //     fc1_weights_memory = memory(fc1_prim_desc.weights_desc(), eng);
-    //     reorder(fc1_user_weights_memory, fc1_weights_memory)
-    //             .execute(s, fc1_user_weights_memory, fc1_weights_memory);
-    // }
-    fc1_weights_memory = memory(fc1_prim_desc.weights_desc(), eng);
-    net_fwd.push_back(reorder(fc1_user_weights_memory, fc1_weights_memory));
-    net_fwd_args.push_back({{DNNL_ARG_FROM, fc1_user_weights_memory},
-            {DNNL_ARG_TO,  fc1_weights_memory}});
-
-
-    auto fc1_dst_memory = memory(fc1_prim_desc.dst_desc(), eng);
-
-    net_fwd.push_back(inner_product_forward(fc1_prim_desc)); 
-    //here in the inner product api has problem, solved the problem is in config.xml
-    net_fwd_args.push_back({{DNNL_ARG_SRC, fc1_src_memory},
-            {DNNL_ARG_WEIGHTS, fc1_weights_memory},
-            {DNNL_ARG_BIAS, fc1_user_bias_memory},
-            {DNNL_ARG_DST, fc1_dst_memory}});
-
-    //relu1
-    // {batch, 1000} -> {batch, 1000}
-    const float negative1_slope = 1.0f;
-
-    // create relu primitive and add it to net
-    // auto relu1_desc = eltwise_forward::desc(prop_kind::forward_inference,
-    //         algorithm::eltwise_relu, fc1_dst_memory.get_desc(),
-    //         negative1_slope);
-    auto relu1_desc = eltwise_forward::desc(prop_kind::forward_inference,
-        algorithm::eltwise_tanh, fc1_dst_memory.get_desc(),
-        negative1_slope);
-    auto relu1_prim_desc = eltwise_forward::primitive_desc(relu1_desc, eng);
-
-    auto relu1_dst_memory = memory(fc1_dst_memory.get_desc(), eng);
-
-    net_fwd.push_back(eltwise_forward(relu1_prim_desc));
-    net_fwd_args.push_back({{DNNL_ARG_SRC, fc1_dst_memory},
-            {DNNL_ARG_DST, relu1_dst_memory}});
-
-    // fc2 inner product {batch, 1000} (x) {1, 1000}-> {batch, 1}
-    memory::dims fc2_weights_tz = {network[2], fc1_node_num};
-    memory::dims fc2_bias_tz = {network[2]};
-    memory::dims fc2_dst_tz = {batch, network[2]};
-
-    fc2_weights = vector<float>(product(fc2_weights_tz));
-    fc2_bias = vector<float>(product(fc2_bias_tz));
-
-    fc2_user_weights_memory
-            = memory({{fc2_weights_tz}, dt::f32, tag::nc}, eng);
-    fc2_user_bias_memory = memory({{fc2_bias_tz}, dt::f32, tag::x}, eng);
-    user_dst_memory = memory({{fc2_dst_tz}, dt::f32, tag::nc}, eng);
-
-        // create memory descriptors for fc2olution data w/ no specified format
-    auto fc2_bias_md = memory::desc({fc2_bias_tz}, dt::f32, tag::any);
-    auto fc2_weights_md = memory::desc({fc2_weights_tz}, dt::f32, tag::any);
-    auto fc2_dst_md = memory::desc({fc2_dst_tz}, dt::f32, tag::any);
-
-    // create a inner_product
-    auto fc2_desc = inner_product_forward::desc(prop_kind::forward_inference,
-            fc1_dst_memory.get_desc(), fc2_weights_md, fc2_bias_md, fc2_dst_md);
-    auto fc2_prim_desc = inner_product_forward::primitive_desc(fc2_desc, eng);
-
-    auto fc2_weights_memory = fc2_user_weights_memory;
-    fc2_weights_memory = memory(fc2_prim_desc.weights_desc(), eng);
-    net_fwd.push_back(reorder(fc2_user_weights_memory, fc2_weights_memory));
-    net_fwd_args.push_back({{DNNL_ARG_FROM, fc2_user_weights_memory},
-            {DNNL_ARG_TO,  fc2_weights_memory}});
+    workspace = NULL;
+    workspace_raw = NULL;
+    workspace_size = 0;
+    bf16 = false;
+    scratch.set_scratchpad_mode(scratchpad_mode::user);
+
+    dims.push_back(input_dim);
+    for(size_t i=0; i<layers.size(); i++){
+        if(layers[i].units > 0){
+            dims.push_back(layers[i].units);
+        }
+    }
 
+    // the weights layout of every inner product is the one its forward picks for the full batch,
+    // the nets of other batch sizes are asked to take it as is
+    vector<memory::desc> weights_md(layers.size());
+    memory::desc cur_md({batch, dims[0]}, dt::f32, tag::nc);
+    param_count = 0;
+    plain_count = 0;
+    weights_offset.assign(layers.size(), 0);
+    bias_offset.assign(layers.size(), 0);
+    int k = 0;
+    for(size_t i=0; i<layers.size(); i++){
+        if(layers[i].units == 0){
+            continue;
+        }
+        auto desc = inner_product_forward::desc(prop_kind::forward_training, cur_md,
+                memory::desc({dims[k+1], dims[k]}, dt::f32, tag::any),
+                memory::desc({dims[k+1]}, dt::f32, tag::any),
+                memory::desc({batch, dims[k+1]}, dt::f32, tag::any));
+        auto pd = inner_product_forward::primitive_desc(desc, eng);
+        weights_md[i] = pd.weights_desc();
+        cur_md = pd.dst_desc();
+        // every tensor starts on 64 bytes
+        weights_offset[i] = param_count;
+        param_count += ((weights_md[i].get_size()+63) & ~(size_t)63)/sizeof(float);
+        bias_offset[i] = param_count;
+        param_count += (dims[k+1]+15) & ~(size_t)15;
+        plain_count += (size_t)(dims[k]+1)*dims[k+1];
+        k++;
+    }
+
+    /// Allocate buffers for weights and bias, shared by the nets of every batch size
+    /// zeroed so the padding of blocked layouts stays zero under every update
+    params = alloc_arena(param_count, &params_raw);
+    memset(params, 0, param_count*sizeof(float));
+    bind_params(weights_md);
+    pool = NULL;
+    keep = 0;
+    shared = false;
+    async = false;
+    loss_sum = 0;
+
+    size_workspace();
+}
+
+//a data parallel worker: computes gradients for a share of master's batches in its own grads,
+//with its own nets, workspace and stream, reading master's parameters in place
+MLP::MLP(MLP* master, int b){
+    eng = master->eng;
+    s = stream(eng);
+    layers = master->layers;
+    dims = master->dims;
+    opt = master->opt;
+    state = NULL;
+    state_raw = NULL;
+    steps = 0;
+    batch = b;
+    workspace = NULL;
+    workspace_raw = NULL;
+    workspace_size = 0;
+    bf16 = master->bf16;
+    scratch = master->scratch;
+    param_count = master->param_count;
+    plain_count = master->plain_count;
+    weights_offset = master->weights_offset;
+    bias_offset = master->bias_offset;
+    vector<memory::desc> weights_md(layers.size());
+    for(size_t i=0; i<layers.size(); i++){
+        if(layers[i].units > 0){
+            weights_md[i] = master->user_weights[i].get_desc();
+        }
+    }
+    params = master->params;
+    params_raw = NULL;
+    bind_params(weights_md);
+    pool = NULL;
+    keep = 0;
+    shared = false;
+    async = false;
+    loss_sum = 0;
+
+    size_workspace();
+}
+
+//grads and the per layer memories over params and grads, weights in the given layouts
+void MLP::bind_params(const vector<memory::desc>& weights_md){
+    grads = alloc_arena(param_count, &grads_raw);
+    memset(grads, 0, param_count*sizeof(float));
+    user_weights.resize(layers.size());
+    user_bias.resize(layers.size());
+    user_diff_weights.resize(layers.size());
+    user_diff_bias.resize(layers.size());
+    int k = 0;
+    for(size_t i=0; i<layers.size(); i++){
+        if(layers[i].units == 0){
+            continue;
+        }
+        memory::dims bias_tz = {dims[k+1]};
+        user_weights[i] = memory(weights_md[i], eng, params+weights_offset[i]);
+        user_bias[i] = memory({{bias_tz}, dt::f32, tag::x}, eng, params+bias_offset[i]);
+        // gradients land in grads at the same offsets as their parameters, in the same layout
+        user_diff_weights[i] = memory(weights_md[i], eng, grads+weights_offset[i]);
+        user_diff_bias[i] = memory({{bias_tz}, dt::f32, tag::x}, eng, grads+bias_offset[i]);
+        k++;
+    }
+}
 
-    auto fc2_dst_memory = memory(fc2_prim_desc.dst_desc(), eng);
-    // auto fc2_dst_memory = user_dst_memory;
+//primitives for one batch size, built on first use. only the full batch net, the share of the
+//master under set_workers and the latest other size are kept: tail sizes change with every
+//unlearning request, inference and tuning add more
+MLP::Net* MLP::get_net(memory::dim b){
+    std::map<memory::dim, Net*>::iterator it = nets.find(b);
+    if(it != nets.end()){
+        return it->second;
+    }
+    Net* n = build_net(b);
+    for(it = nets.begin(); it != nets.end();){
+        if(it->first != batch && it->first != keep){
+            delete it->second;
+            nets.erase(it++);
+        }else{
+            ++it;
+        }
+    }
+    nets[b] = n;
+    if(n->workspace_bytes > workspace_size){
+        printf("batch of %d rows grows the MLP workspace to %d KB\n", (int)b, (int)(n->workspace_bytes>>10));
+        grow_workspace(n->workspace_bytes);
+    }
+    bind_workspace(n);
+    return n;
+}
 
-    // create fc2olution primitive and add it to net
-    net_fwd.push_back(inner_product_forward(fc2_prim_desc));
-    net_fwd_args.push_back({{DNNL_ARG_SRC, relu1_dst_memory},
-            {DNNL_ARG_WEIGHTS, fc2_weights_memory},
-            {DNNL_ARG_BIAS, fc2_user_bias_memory},
-            {DNNL_ARG_DST, fc2_dst_memory}});
+//the arena is allocated once when the MLP is built, for the larger of the full batch net and a
+//batch 1 net, so the peak EPC use is fixed up front: tails, inference chunks and worker shares lie
+//between the two. both nets stay cached, the batch 1 one until another size replaces it
+void MLP::size_workspace(){
+    Net* full = build_net(batch);
+    nets[batch] = full;
+    net = full;
+    size_t bytes = full->workspace_bytes;
+    if(batch > 1){
+        Net* one = build_net(1);
+        nets[1] = one;
+        if(one->workspace_bytes > bytes){
+            bytes = one->workspace_bytes;
+        }
+    }
+    workspace = alloc_arena(bytes/sizeof(float), &workspace_raw);
+    workspace_size = bytes;
+    for(std::map<memory::dim, Net*>::iterator it = nets.begin(); it != nets.end(); ++it){
+        bind_workspace(it->second);
+    }
+}
 
+//DNNL may still pick a layout for a size in between that needs more, then the arena grows and the
+//cached nets move into it rather than the step being dropped
+void MLP::grow_workspace(size_t bytes){
+    free(workspace_raw);
+    workspace = alloc_arena(bytes/sizeof(float), &workspace_raw);
+    workspace_size = bytes;
+    for(std::map<memory::dim, Net*>::iterator it = nets.begin(); it != nets.end(); ++it){
+        bind_workspace(it->second);
+    }
+}
 
-    // relu2
-    // {batch, 1000} -> {batch, 1000}
-    // const float negative1_slope = 1.0f;
+//a workspace memory of desc d, bound once the net knows its total size
+memory MLP::plan(Net* n, const memory::desc& d){
+    memory m(d, eng, DNNL_MEMORY_NONE);
+    n->planned.push_back(std::make_pair(m, n->workspace_bytes));
+    n->workspace_bytes += (d.get_size()+63) & ~(size_t)63;
+    return m;
+}
 
-    // create relu primitive and add it to net
-    // auto relu1_desc = eltwise_forward::desc(prop_kind::forward_inference,
-    //         algorithm::eltwise_relu, fc1_dst_memory.get_desc(),
-    //         negative1_slope);
-    auto relu2_desc = eltwise_forward::desc(prop_kind::forward_inference,
-        algorithm::eltwise_logistic, fc2_dst_memory.get_desc(),
-        negative1_slope);
-    auto relu2_prim_desc = eltwise_forward::primitive_desc(relu2_desc, eng);
+//from itself when it already has desc d, else a planned copy filled by a reorder appended to prims
+memory MLP::reorder_to(Net* n, vector<primitive>& prims, vector<std::unordered_map<int, memory>>& args,
+        const memory& from, const memory::desc& d){
+    if(from.get_desc() == d){
+        return from;
+    }
+    memory to = plan(n, d);
+    reorder::primitive_desc pd(from, to, scratch);
+    reserve_scratchpad(n, pd);
+    prims.push_back(reorder(pd));
+    args.push_back({{DNNL_ARG_FROM, from}, {DNNL_ARG_TO, to}});
+    return to;
+}
 
-    auto relu2_dst_memory = user_dst_memory;
+//primitives of a net run one after another, so they share one user scratchpad of the largest size
+void MLP::reserve_scratchpad(Net* n, const primitive_desc_base& pd){
+    size_t bytes = pd.scratchpad_desc().get_size();
+    if(bytes > n->scratchpad_bytes){
+        n->scratchpad_bytes = bytes;
+    }
+}
 
-    net_fwd.push_back(eltwise_forward(relu2_prim_desc));
-    net_fwd_args.push_back({{DNNL_ARG_SRC, fc2_dst_memory},
-            {DNNL_ARG_DST, relu2_dst_memory}});
+//points the planned memories of n into the arena, which size_workspace made large enough
+void MLP::bind_workspace(Net* n){
+    for(size_t i=0; i<n->planned.size(); i++){
+        n->planned[i].first.set_data_handle((char*)workspace+n->planned[i].second);
+    }
+}
 
+//C argument arrays of the arg maps, they hold the memory handles, so rebinding a memory's data
+//handle (the input, a workspace move) does not invalidate them
+static void exec_args(const vector<std::unordered_map<int, memory>>& args, vector<vector<dnnl_exec_arg_t>>& out){
+    out.resize(args.size());
+    for(size_t i=0; i<args.size(); i++){
+        for(std::unordered_map<int, memory>::const_iterator it = args[i].begin(); it != args[i].end(); ++it){
+            dnnl_exec_arg_t a = {it->first, it->second.get()};
+            out[i].push_back(a);
+        }
+    }
+}
 
+//run one primitive of a net without allocating
+static inline void execute(const primitive& p, const stream& s, const vector<dnnl_exec_arg_t>& args){
+    error::wrap_c_api(dnnl_primitive_execute(p.get(), s.get(), (int)args.size(), args.data()),
+            "could not execute a primitive");
+}
 
+//forward and backward primitives of the layer list for batch b, every buffer but the
+//parameters and the caller's input is planned into the workspace. in bf16 mode the
+//activations, their gradients and a per step bf16 copy of the weights are bf16, while
+//the loss, the weight and bias gradients and the fp32 master weights stay fp32
+MLP::Net* MLP::build_net(memory::dim b){
+    Net* n = new Net();
+    n->batch = b;
+    n->workspace_bytes = 0;
+    n->scratchpad_bytes = 0;
+    n->src_memory = memory({{b, dims[0]}, dt::f32, tag::nc}, eng, DNNL_MEMORY_NONE);
+    const dt act = bf16 ? dt::bf16 : dt::f32;
+
+    //what backward needs of every layer
+    vector<inner_product_forward::primitive_desc> ip_pd(layers.size());
+    vector<eltwise_forward::primitive_desc> act_pd(layers.size());
+    vector<memory> src(layers.size()); //for an activation fused into its inner product, its dst
+    vector<memory> weights(layers.size());
+    vector<bool> fused(layers.size(), false);
+
+    memory cur = reorder_to(n, n->fwd, n->fwd_args, n->src_memory, memory::desc({b, dims[0]}, act, tag::nc));
+    int k = 0;
+    for(size_t i=0; i<layers.size(); i++){
+        src[i] = cur;
+        if(layers[i].units > 0){
+            // inner product {b, dims[k]} (x) {dims[k+1], dims[k]} -> {b, dims[k+1]}
+            memory::dims weights_tz = {dims[k+1], dims[k]};
+            memory::dims bias_tz = {dims[k+1]};
+            memory::dims dst_tz = {b, dims[k+1]};
+            auto bias_md = memory::desc({bias_tz}, dt::f32, tag::any);
+            auto dst_md = memory::desc({dst_tz}, act, tag::any);
+            // the next activation runs as a post-op, its use_dst_for_bwd form lets backward work
+            // from the fused output alone. preference: post-op with the stored weights layout,
+            // post-op with a reordered copy, then the same without the post-op. bf16 always reorders
+            bool fuse = i+1 < layers.size() && layers[i+1].units == 0 && !layers[i+1].softmax;
+            primitive_attr attr = scratch;
+            if(fuse){
+                post_ops ops;
+                ops.append_eltwise(1.0f, use_dst_for_bwd(layers[i+1].activation), 0.0f, 0.0f);
+                attr.set_post_ops(ops);
+            }
+            for(int attempt=0; attempt<4; attempt++){
+                bool with_ops = attempt < 2;
+                bool stored = attempt%2 == 0;
+                if((with_ops && !fuse) || (stored && bf16)){
+                    continue;
+                }
+                try {
+                    auto desc = inner_product_forward::desc(prop_kind::forward_training, cur.get_desc(),
+                            stored ? user_weights[i].get_desc() : memory::desc({weights_tz}, act, tag::any),
+                            bias_md, dst_md);
+                    ip_pd[i] = inner_product_forward::primitive_desc(desc, with_ops ? attr : scratch, eng);
+                    if(fuse){
+                        fused[i+1] = with_ops;
+                    }
+                    break;
+                } catch (error &e) {
+                    if(attempt == 3){
+                        throw;
+                    }
+                }
+            }
+            reserve_scratchpad(n, ip_pd[i]);
+            weights[i] = reorder_to(n, n->fwd, n->fwd_args, user_weights[i], ip_pd[i].weights_desc());
+            memory dst = plan(n, ip_pd[i].dst_desc());
+            n->fwd.push_back(inner_product_forward(ip_pd[i]));
+            //here in the inner product api has problem, solved the problem is in config.xml
+            n->fwd_args.push_back({{DNNL_ARG_SRC, cur},
+                    {DNNL_ARG_WEIGHTS, weights[i]},
+                    {DNNL_ARG_BIAS, user_bias[i]},
+                    {DNNL_ARG_DST, dst}});
+            cur = dst;
+            k++;
+        }else if(layers[i].softmax){
+            // class probabilities over the plain fp32 logits, also in bf16 mode so the loss and
+            // argmax see fp32. the output layer, its backward is fused into the loss below
+            memory logits = reorder_to(n, n->fwd, n->fwd_args, cur, memory::desc({b, dims.back()}, dt::f32, tag::nc));
+            auto desc = softmax_forward::desc(prop_kind::forward_training, logits.get_desc(), 1);
+            auto pd = softmax_forward::primitive_desc(desc, scratch, eng);
+            reserve_scratchpad(n, pd);
+            memory dst = plan(n, pd.dst_desc());
+            n->fwd.push_back(softmax_forward(pd));
+            n->fwd_args.push_back({{DNNL_ARG_SRC, logits},
+                    {DNNL_ARG_DST, dst}});
+            cur = dst;
+        }else if(fused[i]){
+            // already applied by the inner product, the forward desc is only the backward hint
+            auto desc = eltwise_forward::desc(prop_kind::forward_training,
+                    use_dst_for_bwd(layers[i].activation), cur.get_desc(), 0.0f);
+            act_pd[i] = eltwise_forward::primitive_desc(desc, eng);
+        }else{
+            // activation in place of shape, relu uses a zero negative slope
+            auto desc = eltwise_forward::desc(prop_kind::forward_training,
+                    layers[i].activation, cur.get_desc(), 0.0f);
+            act_pd[i] = eltwise_forward::primitive_desc(desc, scratch, eng);
+            reserve_scratchpad(n, act_pd[i]);
+            memory dst = plan(n, cur.get_desc());
+            n->fwd.push_back(eltwise_forward(act_pd[i]));
+            n->fwd_args.push_back({{DNNL_ARG_SRC, cur},
+                    {DNNL_ARG_DST, dst}});
+            cur = dst;
+        }
+    }
+    // the loss reads the output as plain {b, 1}, or {b, classes} for softmax
+    memory::desc out_md({b, dims.back()}, dt::f32, tag::nc);
+    n->out_memory = reorder_to(n, n->fwd, n->fwd_args, cur, out_md);
 
     //-----------------------------------------------------------------------
     //----------------- Backward Stream -------------------------------------
-    // ... user diff_data ...
-    net_diff_dst = vector<float>(batch * network[2]);
-    fc2_user_diff_dst_memory
-        = memory({{fc2_dst_tz}, dt::f32, tag::nc}, eng);
-
-    // Backward relu
-    // auto relu1_diff_dst_md = memory::desc({relu1_data_tz}, dt::f32, tag::any);
-    auto relu2_diff_dst_md = fc2_prim_desc.dst_desc();
-    auto relu2_src_md = fc2_prim_desc.dst_desc();
-
-    // create backward relu primitive_descriptor
-    // auto relu1_bwd_desc = eltwise_backward::desc(algorithm::eltwise_relu,
-    //         relu1_diff_dst_md, relu1_src_md, negative1_slope);
-    auto relu2_bwd_desc = eltwise_backward::desc(algorithm::eltwise_logistic,
-            relu2_diff_dst_md, relu2_src_md, negative1_slope);
-    auto relu2_bwd_pd
-            = eltwise_backward::primitive_desc(relu2_bwd_desc, eng, relu2_prim_desc);
-
-    // create reorder primitive between lrn diff src and relu diff dst
-    // if required
-    auto relu2_diff_dst_memory = fc2_user_diff_dst_memory;
-    relu2_diff_dst_memory = memory(relu2_bwd_pd.diff_dst_desc(), eng);
-    net_bwd.push_back(reorder(fc2_user_diff_dst_memory, relu2_diff_dst_memory));
-    net_bwd_args.push_back({{DNNL_ARG_FROM, fc2_user_diff_dst_memory},
-            {DNNL_ARG_TO, relu2_diff_dst_memory}});
-
-    // create memory for relu diff src
-    auto relu2_diff_src_memory = memory(relu2_bwd_pd.diff_src_desc(), eng);
-
-    // finally create a backward relu primitive
-    net_bwd.push_back(eltwise_backward(relu2_bwd_pd));
-    net_bwd_args.push_back({{DNNL_ARG_SRC, fc2_dst_memory},
-            {DNNL_ARG_DIFF_DST, relu2_diff_dst_memory},
-            {DNNL_ARG_DIFF_SRC, relu2_diff_src_memory}});
-
-
-
-    // fc2_user_diff_dst_memory
-    //         = memory({{fc2_dst_tz}, dt::f32, tag::nc}, eng);
-    fc2_user_diff_weights_buffer = vector<float>(product(fc2_weights_tz));
-    fc2_diff_bias_buffer = vector<float>(product(fc2_bias_tz));
-    fc2_user_diff_weights_memory
-            = memory({{fc2_weights_tz}, dt::f32, tag::nc}, eng);
-    fc2_diff_bias_memory = memory({{fc2_bias_tz}, dt::f32, tag::x}, eng);
-
-
-    // create memory descriptors
-    auto fc2_bwd_src_md = memory::desc({fc1_dst_tz}, dt::f32, tag::any);
-    auto fc2_diff_bias_md = memory::desc({fc2_bias_tz}, dt::f32, tag::any);
-    auto fc2_diff_weights_md
-            = memory::desc({fc2_weights_tz}, dt::f32, tag::any);
-    auto fc2_diff_dst_md = memory::desc({fc2_dst_tz}, dt::f32, tag::any);
-
-    // create backward fc2olution primitive descriptor
-    auto fc2_bwd_weights_desc
-            = inner_product_backward_weights::desc(
-                    fc2_bwd_src_md, fc2_diff_weights_md, fc2_diff_bias_md,
-                    fc2_diff_dst_md);
-    auto fc2_bwd_weights_pd = inner_product_backward_weights::primitive_desc(
-            fc2_bwd_weights_desc, eng, fc2_prim_desc);
-    
-    auto fc2_bwd_src_memory = relu1_dst_memory;
-    fc2_bwd_src_memory = memory(fc2_bwd_weights_pd.src_desc(), eng);
-    net_bwd.push_back(reorder(relu1_dst_memory, fc2_bwd_src_memory));
-    net_bwd_args.push_back({{DNNL_ARG_FROM, relu1_dst_memory},
-            {DNNL_ARG_TO, fc2_bwd_src_memory}});
-    // auto fc2_diff_dst_memory = fc2_user_diff_dst_memory;
-    auto fc2_diff_dst_memory = relu2_diff_src_memory;
-    fc2_diff_dst_memory = memory(fc2_dst_memory.get_desc(), eng);
-    net_bwd.push_back(
-            reorder(relu2_diff_src_memory, fc2_diff_dst_memory));
-    net_bwd_args.push_back({{DNNL_ARG_FROM, relu2_diff_src_memory},
-            {DNNL_ARG_TO, fc2_diff_dst_memory}});
-
-    // create backward fc2olution primitive
-    net_bwd.push_back(inner_product_backward_weights(fc2_bwd_weights_pd));
-    net_bwd_args.push_back({{DNNL_ARG_SRC, fc2_bwd_src_memory},
-            {DNNL_ARG_DIFF_DST, fc2_diff_dst_memory},
-            // delay putting DIFF_WEIGHTS until reorder (if needed)
-            {DNNL_ARG_DIFF_BIAS, fc2_diff_bias_memory}});
-    auto fc2_diff_weights_memory = fc2_user_diff_weights_memory;
-    fc2_diff_weights_memory
-        = memory(fc2_bwd_weights_pd.diff_weights_desc(), eng);
-    net_bwd_args.back().insert(
-        {DNNL_ARG_DIFF_WEIGHTS, fc2_diff_weights_memory});
-    net_bwd.push_back(reorder(
-            fc2_diff_weights_memory, fc2_user_diff_weights_memory));
-    net_bwd_args.push_back({{DNNL_ARG_FROM, fc2_diff_weights_memory},
-            {DNNL_ARG_TO, fc2_user_diff_weights_memory}});
-
+    // the output sigmoid and the BCE loss are differentiated together, loss_diff_memory holds
+    // p - y wrt the last inner product's dst and the logistic eltwise_backward is skipped. the
+    // same goes for softmax and cross entropy, with p - onehot(y) and no softmax_backward
+    n->loss_diff_memory = plan(n, out_md);
+    memory diff = n->loss_diff_memory;
+    for(int i=(int)layers.size()-2; i>=0; i--){
+        if(layers[i].units == 0){
+            algorithm alg = fused[i] ? use_dst_for_bwd(layers[i].activation) : layers[i].activation;
+            auto desc = eltwise_backward::desc(alg,
+                    act_pd[i].dst_desc(), src[i].get_desc(), 0.0f);
+            auto pd = eltwise_backward::primitive_desc(desc, scratch, eng, act_pd[i]);
+            reserve_scratchpad(n, pd);
+            memory diff_dst = reorder_to(n, n->bwd, n->bwd_args, diff, pd.diff_dst_desc());
+            memory diff_src = plan(n, pd.diff_src_desc());
+            n->bwd.push_back(eltwise_backward(pd));
+            n->bwd_args.push_back({{fused[i] ? DNNL_ARG_DST : DNNL_ARG_SRC, src[i]},
+                    {DNNL_ARG_DIFF_DST, diff_dst},
+                    {DNNL_ARG_DIFF_SRC, diff_src}});
+            diff = diff_src;
+            continue;
+        }
+        k--;
+        memory::dims weights_tz = {dims[k+1], dims[k]};
+        memory::dims bias_tz = {dims[k+1]};
+        memory::dims dst_tz = {b, dims[k+1]};
+
+        // Backward inner_product with respect to weights, straight into grads in the stored layout
+        auto diff_bias_md = memory::desc({bias_tz}, dt::f32, tag::any);
+        auto diff_dst_md = memory::desc({dst_tz}, act, tag::any);
+        inner_product_backward_weights::primitive_desc bwd_weights_pd;
+        try {
+            auto bwd_weights_desc = inner_product_backward_weights::desc(
+                    src[i].get_desc(), user_diff_weights[i].get_desc(), diff_bias_md, diff_dst_md);
+            bwd_weights_pd = inner_product_backward_weights::primitive_desc(
+                    bwd_weights_desc, scratch, eng, ip_pd[i]);
+        } catch (error &e) {
+            auto bwd_weights_desc = inner_product_backward_weights::desc(
+                    src[i].get_desc(), memory::desc({weights_tz}, dt::f32, tag::any), diff_bias_md, diff_dst_md);
+            bwd_weights_pd = inner_product_backward_weights::primitive_desc(
+                    bwd_weights_desc, scratch, eng, ip_pd[i]);
+        }
+        reserve_scratchpad(n, bwd_weights_pd);
+        memory bwd_src = reorder_to(n, n->bwd, n->bwd_args, src[i], bwd_weights_pd.src_desc());
+        memory bwd_diff_dst = reorder_to(n, n->bwd, n->bwd_args, diff, bwd_weights_pd.diff_dst_desc());
+        bool direct = bwd_weights_pd.diff_weights_desc() == user_diff_weights[i].get_desc();
+        memory diff_weights = direct ? user_diff_weights[i] : plan(n, bwd_weights_pd.diff_weights_desc());
+        n->bwd.push_back(inner_product_backward_weights(bwd_weights_pd));
+        n->bwd_args.push_back({{DNNL_ARG_SRC, bwd_src},
+                {DNNL_ARG_DIFF_DST, bwd_diff_dst},
+                {DNNL_ARG_DIFF_WEIGHTS, diff_weights},
+                {DNNL_ARG_DIFF_BIAS, user_diff_bias[i]}});
+        if(!direct){
+            reorder::primitive_desc pd(diff_weights, user_diff_weights[i], scratch);
+            reserve_scratchpad(n, pd);
+            n->bwd.push_back(reorder(pd));
+            n->bwd_args.push_back({{DNNL_ARG_FROM, diff_weights},
+                    {DNNL_ARG_TO, user_diff_weights[i]}});
+        }
+        if(k == 0){
+            break; // nothing wants the gradient of the input
+        }
 
         //Backward inner_product with respect to data
-    // create memory descriptors for inner-product
-    auto fc2_diff_src_md = memory::desc({fc1_dst_tz}, dt::f32, tag::any);
-    // auto fc2_diff_dst_md = memory::desc({fc2_dst_tz}, dt::f32, tag::any);
-    
-    // create backward fc2ing descriptor
-    auto fc2_bwd_desc = inner_product_backward_data::desc(
-            fc2_diff_src_md, fc2_weights_md, fc2_diff_dst_md);
-    // backward primitive descriptor needs to hint forward descriptor
-    auto fc2_bwd_pd
-            = inner_product_backward_data::primitive_desc(fc2_bwd_desc, eng, fc2_prim_desc);
-
-    auto fc2_diff_src_memory = memory(fc2_bwd_pd.diff_src_desc(), eng);
-
-    // finally create backward fc2ing primitive
-    net_bwd.push_back(inner_product_backward_data(fc2_bwd_pd));
-    net_bwd_args.push_back({{DNNL_ARG_WEIGHTS, fc2_weights_memory},
-            // {DNNL_ARG_BIAS, fc2_user_bias_memory},
-            {DNNL_ARG_DIFF_DST, fc2_diff_dst_memory},
-            {DNNL_ARG_DIFF_SRC, fc2_diff_src_memory}});  
-
-    // Backward relu
-    // auto relu1_diff_dst_md = memory::desc({relu1_data_tz}, dt::f32, tag::any);
-    auto relu1_diff_dst_md = fc1_prim_desc.dst_desc();
-    auto relu1_src_md = fc1_prim_desc.dst_desc();
-
-    // create backward relu primitive_descriptor
-    // auto relu1_bwd_desc = eltwise_backward::desc(algorithm::eltwise_relu,
-    //         relu1_diff_dst_md, relu1_src_md, negative1_slope);
-    auto relu1_bwd_desc = eltwise_backward::desc(algorithm::eltwise_tanh,
-            relu1_diff_dst_md, relu1_src_md, negative1_slope);
-    auto relu1_bwd_pd
-            = eltwise_backward::primitive_desc(relu1_bwd_desc, eng, relu1_prim_desc);
-
-    // create reorder primitive between lrn diff src and relu diff dst
-    // if required
-    auto relu1_diff_dst_memory = fc2_diff_src_memory;
-    relu1_diff_dst_memory = memory(relu1_bwd_pd.diff_dst_desc(), eng);
-    net_bwd.push_back(reorder(fc2_diff_src_memory, relu1_diff_dst_memory));
-    net_bwd_args.push_back({{DNNL_ARG_FROM, fc2_diff_src_memory},
-            {DNNL_ARG_TO, relu1_diff_dst_memory}});
-
-    // create memory for relu diff src
-    auto relu1_diff_src_memory = memory(relu1_bwd_pd.diff_src_desc(), eng);
-
-    // finally create a backward relu primitive
-    net_bwd.push_back(eltwise_backward(relu1_bwd_pd));
-    net_bwd_args.push_back({{DNNL_ARG_SRC, fc1_dst_memory},
-            {DNNL_ARG_DIFF_DST, relu1_diff_dst_memory},
-            {DNNL_ARG_DIFF_SRC, relu1_diff_src_memory}});
-
-    // Backward inner_product with respect to weights
-    // create user format diff weights and diff bias memory
-    fc1_user_diff_weights_buffer = vector<float>(product(fc1_weights_tz));
-    fc1_diff_bias_buffer = vector<float>(product(fc1_bias_tz));
-
-    fc1_user_diff_weights_memory
-            = memory({{fc1_weights_tz}, dt::f32, tag::nc}, eng);
-    fc1_diff_bias_memory = memory({{fc1_bias_tz}, dt::f32, tag::x}, eng);
-
-    // create memory descriptors
-    auto fc1_bwd_src_md = memory::desc({fc1_src_tz}, dt::f32, tag::any);
-    auto fc1_diff_bias_md = memory::desc({fc1_bias_tz}, dt::f32, tag::any);
-    auto fc1_diff_weights_md
-            = memory::desc({fc1_weights_tz}, dt::f32, tag::any);
-    auto fc1_diff_dst_md = memory::desc({fc1_dst_tz}, dt::f32, tag::any);
-
-    // create backward fc2olution primitive descriptor
-    auto fc1_bwd_weights_desc
-            = inner_product_backward_weights::desc(
-                    fc1_bwd_src_md, fc1_diff_weights_md, fc1_diff_bias_md,
-                    fc1_diff_dst_md);
-    auto fc1_bwd_weights_pd = inner_product_backward_weights::primitive_desc(
-            fc1_bwd_weights_desc, eng, fc1_prim_desc);
-
-    auto fc1_bwd_src_memory = fc1_src_memory;
-    fc1_bwd_src_memory = memory(fc1_bwd_weights_pd.src_desc(), eng);
-    net_bwd.push_back(reorder(fc1_src_memory, fc1_bwd_src_memory));
-    net_bwd_args.push_back({{DNNL_ARG_FROM, fc1_src_memory},
-            {DNNL_ARG_TO, fc1_bwd_src_memory}});
-
-    auto fc1_diff_dst_memory = relu1_diff_src_memory;
-    fc1_diff_dst_memory = memory(fc1_dst_memory.get_desc(), eng);
-    net_bwd.push_back(
-            reorder(relu1_diff_src_memory, fc1_diff_dst_memory));
-    net_bwd_args.push_back({{DNNL_ARG_FROM, relu1_diff_src_memory},
-            {DNNL_ARG_TO, fc1_diff_dst_memory}});
-
-
-    // create backward fc2olution primitive
-    net_bwd.push_back(inner_product_backward_weights(fc1_bwd_weights_pd));
-    net_bwd_args.push_back({{DNNL_ARG_SRC, fc1_bwd_src_memory},
-            {DNNL_ARG_DIFF_DST, fc1_diff_dst_memory},
-            // delay putting DIFF_WEIGHTS until reorder (if needed)
-            {DNNL_ARG_DIFF_BIAS, fc1_diff_bias_memory}});
-    auto fc1_diff_weights_memory = fc1_user_diff_weights_memory;
-    fc1_diff_weights_memory
-            = memory(fc1_bwd_weights_pd.diff_weights_desc(), eng);
-    net_bwd_args.back().insert(
-                {DNNL_ARG_DIFF_WEIGHTS, fc1_diff_weights_memory});
-    net_bwd.push_back(reorder(
-            fc1_diff_weights_memory, fc1_user_diff_weights_memory));
-    net_bwd_args.push_back({{DNNL_ARG_FROM, fc1_diff_weights_memory},
-            {DNNL_ARG_TO, fc1_user_diff_weights_memory}});
-    
+        auto diff_src_md = memory::desc({b, dims[k]}, act, tag::any);
+        // backward primitive descriptor needs to hint forward descriptor
+        inner_product_backward_data::primitive_desc bwd_data_pd;
+        try {
+            auto bwd_data_desc = inner_product_backward_data::desc(
+                    diff_src_md, weights[i].get_desc(), diff_dst_md);
+            bwd_data_pd = inner_product_backward_data::primitive_desc(bwd_data_desc, scratch, eng, ip_pd[i]);
+        } catch (error &e) {
+            auto bwd_data_desc = inner_product_backward_data::desc(
+                    diff_src_md, memory::desc({weights_tz}, act, tag::any), diff_dst_md);
+            bwd_data_pd = inner_product_backward_data::primitive_desc(bwd_data_desc, scratch, eng, ip_pd[i]);
+        }
+        reserve_scratchpad(n, bwd_data_pd);
+        memory bwd_weights = weights[i];
+        if(bwd_data_pd.weights_desc() != bwd_weights.get_desc()){
+            bwd_weights = reorder_to(n, n->bwd, n->bwd_args, user_weights[i], bwd_data_pd.weights_desc());
+        }
+        memory data_diff_dst = reorder_to(n, n->bwd, n->bwd_args, diff, bwd_data_pd.diff_dst_desc());
+        memory diff_src = plan(n, bwd_data_pd.diff_src_desc());
+        n->bwd.push_back(inner_product_backward_data(bwd_data_pd));
+        n->bwd_args.push_back({{DNNL_ARG_WEIGHTS, bwd_weights},
+                {DNNL_ARG_DIFF_DST, data_diff_dst},
+                {DNNL_ARG_DIFF_SRC, diff_src}});
+        diff = diff_src;
+    }
+
+    // the shared scratchpad goes into the workspace with everything else
+    if(n->scratchpad_bytes > 0){
+        memory pad = plan(n, memory::desc({(memory::dim)n->scratchpad_bytes}, dt::u8, tag::x));
+        for(size_t i=0; i<n->fwd_args.size(); i++){
+            n->fwd_args[i].insert({DNNL_ARG_SCRATCHPAD, pad});
+        }
+        for(size_t i=0; i<n->bwd_args.size(); i++){
+            n->bwd_args[i].insert({DNNL_ARG_SCRATCHPAD, pad});
+        }
+    }
+
     // didn't we forget anything?
-    assert(net_fwd.size() == net_fwd_args.size() && "something is missing");
-    assert(net_bwd.size() == net_bwd_args.size() && "something is missing");
+    assert(n->fwd.size() == n->fwd_args.size() && "something is missing");
+    assert(n->bwd.size() == n->bwd_args.size() && "something is missing");
+    exec_args(n->fwd_args, n->fwd_exec);
+    exec_args(n->bwd_args, n->bwd_exec);
+    return n;
+}
+
+MLP::~MLP(){
+    set_workers(1);
+    for(std::map<memory::dim, Net*>::iterator it = nets.begin(); it != nets.end(); ++it){
+        delete it->second;
+    }
+    free(params_raw);
+    free(grads_raw);
+    free(state_raw);
+    free(workspace_raw);
+}
+
+//the optimizer state starts at zero, setModel then resumes it from a checkpoint
+void MLP::set_optimizer(int kind, float lr){
+    opt.kind = kind;
+    opt.lr = lr;
+    free(state_raw);
+    state = NULL;
+    state_raw = NULL;
+    size_t count = optimizer_state_count(kind)*param_count;
+    if(count > 0){
+        state = alloc_arena(count, &state_raw);
+        memset(state, 0, count*sizeof(float));
+    }
+    steps = 0;
+}
+
+//bf16 primitives need AVX-512 (BF16/AMX for speed), without an implementation training stays fp32.
+//the cached nets and the workspace are rebuilt, the parameters and checkpoints are fp32 either way
+void MLP::set_precision(int enable){
+    for(std::map<memory::dim, Net*>::iterator it = nets.begin(); it != nets.end(); ++it){
+        delete it->second;
+    }
+    nets.clear();
+    free(workspace_raw);
+    workspace = NULL;
+    workspace_raw = NULL;
+    workspace_size = 0;
+    bf16 = enable != 0;
+    try {
+        size_workspace();
+    } catch (error &e) {
+        printf("bf16 training is not supported on this CPU, it stays fp32\n");
+        for(std::map<memory::dim, Net*>::iterator it = nets.begin(); it != nets.end(); ++it){
+            delete it->second;
+        }
+        nets.clear();
+        bf16 = false;
+        size_workspace();
+    }
 }
 
-void MLP::forward(const vector<float>& input){
-    user_src = vector<float>(input);
-    write_to_dnnl_memory(user_src.data(), user_src_memory);
-    write_to_dnnl_memory(fc1_weights.data(), fc1_user_weights_memory);
-    write_to_dnnl_memory(fc1_bias.data(), fc1_user_bias_memory);
-    write_to_dnnl_memory(fc2_weights.data(), fc2_user_weights_memory);
-    write_to_dnnl_memory(fc2_bias.data(), fc2_user_bias_memory);
+//runs the current net, input is read in place and has to stay alive until backward
+void MLP::forward(const float* input){
+    net->src_memory.set_data_handle((void*)input);
 
-    for (size_t i = 0; i < net_fwd.size(); ++i)
-        net_fwd.at(i).execute(s, net_fwd_args.at(i));
-    read_from_dnnl_memory(user_dst.data(), user_dst_memory);
-    // printf("sigmoid output is %f\n", ((float*)net_fwd_args.at(5)[DNNL_ARG_DST].get_data_handle())[0]);
-    // printf("x is %f\n", ((float*)net_fwd_args.at(4)[DNNL_ARG_SRC].get_data_handle())[0]);
+    for (size_t i = 0; i < net->fwd.size(); ++i)
+        execute(net->fwd[i], s, net->fwd_exec[i]);
+}
 
+//gradient of BCE(sigmoid(z), y) wrt z, d = p - y; finite for every p unlike -y/p + (1-y)/(1-p)
+static inline void sigmoid_bce_grad(const float* p, const float* y, float* d, size_t n){
+    size_t i = 0;
+#if defined(__AVX512F__)
+    for(; i+16<=n; i+=16){
+        _mm512_storeu_ps(d+i, _mm512_sub_ps(_mm512_loadu_ps(p+i), _mm512_loadu_ps(y+i)));
+    }
+#elif defined(__AVX2__)
+    for(; i+8<=n; i+=8){
+        _mm256_storeu_ps(d+i, _mm256_sub_ps(_mm256_loadu_ps(p+i), _mm256_loadu_ps(y+i)));
+    }
+#endif
+    for(; i<n; i++){
+        d[i] = p[i]-y[i];
+    }
 }
 
-void MLP::backward(const vector<float>& label){
-    for(int i=0; i<batch; i++){
-        float y = label[i];
-        // net_diff_dst[i] = label[i]-user_dst[i];
-        // net_diff_dst[i] = 0.05f;
-        net_diff_dst[i] = -y/user_dst[i]+(1-y)/(1-user_dst[i]);
-        // net_diff_dst[i*2+1] = -y/user_dst[i*2+1]-(1-y)/(1-user_dst[i*2+1]);
-        // net_diff_dst[i*2] = 100.0;
-        // net_diff_dst[i*2+1] = 10.0;
+//summed BCE of a batch for the loss curve, p is clamped so saturated outputs stay finite
+static inline double bce_loss_sum(const float* p, const float* y, size_t n){
+    double sum = 0;
+    for(size_t i=0; i<n; i++){
+        float q = p[i] < 1e-7f ? 1e-7f : p[i] > 1-1e-7f ? 1-1e-7f : p[i];
+        sum -= y[i]*logf(q)+(1-y[i])*logf(1-q);
     }
-    // printf("batch is %d\n", batch);
-    // printf("label is %f\n", label[100]);
-    // printf("user dst is %f\n", user_dst[0]);
-    // printf("diff is %f\n", net_diff_dst[0]);
-    write_to_dnnl_memory(net_diff_dst.data(), fc2_user_diff_dst_memory);
-    for (size_t i = 0; i < net_bwd.size(); ++i){
-            net_bwd.at(i).execute(s, net_bwd_args.at(i));
+    return sum;
+}
+
+//gradient of CE(softmax(z), y) wrt z for n rows of k classes, d = p - onehot(y). y holds class
+//indices, a row with an index outside 0..k-1 gets no target. returns the summed loss -log p[y]
+static inline double softmax_ce_grad(const float* p, const float* y, float* d, size_t n, int k){
+    memcpy(d, p, n*k*sizeof(float));
+    double sum = 0;
+    for(size_t i=0; i<n; i++){
+        int c = (int)y[i];
+        if(c >= 0 && c < k){
+            d[i*k+c] -= 1.0f;
+            sum -= logf(p[i*k+c] < 1e-7f ? 1e-7f : p[i*k+c]);
+        }
     }
-    // printf("sigmoid source diff is %.12f\n", ((float*)net_bwd_args.at(1)[DNNL_ARG_DIFF_SRC].get_data_handle())[0]);
+    return sum;
+}
 
-    // printf("x in backward is %f\n", ((float*)net_bwd_args.at(4)[DNNL_ARG_SRC].get_data_handle())[0]);
-    // printf("dst diff is %f\n", ((float*)net_bwd_args.at(4)[DNNL_ARG_DIFF_DST].get_data_handle())[0]);
-    // printf("weight diff is %f\n", ((float*)net_bwd_args.at(4)[DNNL_ARG_DIFF_WEIGHTS].get_data_handle())[0]);
-    // printf("bias diff is %f\n", ((float*)net_bwd_args.at(4)[DNNL_ARG_DIFF_BIAS].get_data_handle())[0]);
+//index of the largest of the k values of every row, the first one on ties like numpy.argmax.
+//one pass for the max and one for its position, both 16 or 8 lanes wide
+static inline void argmax_rows(const float* p, size_t n, int k, float* out){
+    for(size_t i=0; i<n; i++){
+        const float* row = p+i*k;
+        int j = 0;
+        float best = row[0];
+#if defined(__AVX512F__)
+        if(k >= 16){
+            __m512 vmax = _mm512_loadu_ps(row);
+            for(j=16; j+16<=k; j+=16){
+                vmax = _mm512_max_ps(vmax, _mm512_loadu_ps(row+j));
+            }
+            best = _mm512_reduce_max_ps(vmax);
+        }
+#elif defined(__AVX2__)
+        if(k >= 8){
+            __m256 vmax = _mm256_loadu_ps(row);
+            for(j=8; j+8<=k; j+=8){
+                vmax = _mm256_max_ps(vmax, _mm256_loadu_ps(row+j));
+            }
+            __m128 m = _mm_max_ps(_mm256_castps256_ps128(vmax), _mm256_extractf128_ps(vmax, 1));
+            m = _mm_max_ps(m, _mm_movehl_ps(m, m));
+            m = _mm_max_ss(m, _mm_shuffle_ps(m, m, 1));
+            best = _mm_cvtss_f32(m);
+        }
+#endif
+        for(; j<k; j++){
+            best = row[j] > best ? row[j] : best;
+        }
+        j = 0;
+#if defined(__AVX512F__)
+        __m512 vbest = _mm512_set1_ps(best);
+        for(; j+16<=k; j+=16){
+            __mmask16 hit = _mm512_cmp_ps_mask(_mm512_loadu_ps(row+j), vbest, _CMP_EQ_OQ);
+            if(hit){
+                j += __builtin_ctz(hit);
+                break;
+            }
+        }
+#elif defined(__AVX2__)
+        __m256 vbest = _mm256_set1_ps(best);
+        for(; j+8<=k; j+=8){
+            int hit = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(row+j), vbest, _CMP_EQ_OQ));
+            if(hit){
+                j += __builtin_ctz(hit);
+                break;
+            }
+        }
+#endif
+        while(j < k-1 && row[j] != best){
+            j++;
+        }
+        out[i] = (float)j;
+    }
+}
+
+void MLP::backward(const float* label){
+    compute_grads(label);
+    //grads mirrors params, so every layer is updated in one pass
+    optimizer_step(opt, params, grads, state, param_count, 1.0f/net->batch, ++steps);
+}
+
+//batch sums of the gradients of the current net into grads, no update
+void MLP::compute_grads(const float* label){
+    const float* user_dst = (const float*)net->out_memory.get_data_handle();
+    float* net_diff_dst = (float*)net->loss_diff_memory.get_data_handle();
+    if(layers.back().softmax){
+        loss_sum += softmax_ce_grad(user_dst, label, net_diff_dst, net->batch, dims.back());
+    }else{
+        sigmoid_bce_grad(user_dst, label, net_diff_dst, net->batch);
+        loss_sum += bce_loss_sum(user_dst, label, net->batch);
+    }
+    for (size_t i = 0; i < net->bwd.size(); ++i){
+            execute(net->bwd[i], s, net->bwd_exec[i]);
+    }
+}
+
+//persistent workers of set_workers, woken once per batch
+struct MLP::Pool{
+    vector<MLP*> replicas; //replicas[i] runs share i+1, the master runs share 0
+    vector<pthread_t> threads;
+    sgx_thread_mutex_t lock = SGX_THREAD_MUTEX_INITIALIZER;
+    sgx_thread_cond_t start = SGX_THREAD_COND_INITIALIZER;
+    sgx_thread_cond_t done = SGX_THREAD_COND_INITIALIZER;
+    int generation; //bumped for every batch
+    int pending; //workers still running the current batch
+    int stopping;
+    int omp_threads; //DNNL threads of each worker, the TCS are split between them
+    const float* x;
+    const float* y;
+    int n;
+    int part; //rows of every share but the last
+    //asynchronous epochs: every thread trains on its own range of order and updates params itself
+    bool hogwild;
+    const float* data;
+    const float* label;
+    const int* order;
+};
+
+struct WorkerArg{
+    MLP* master;
+    int index;
+};
+
+//gradients of rows [index*part, (index+1)*part) of the current batch, an empty share does nothing
+void MLP::run_share(int index){
+    int first = index*pool->part;
+    int count = pool->n-first < pool->part ? pool->n-first : pool->part;
+    MLP* m = index == 0 ? this : pool->replicas[index-1];
+    m->shared = count > 0;
+    if(count <= 0){
+        return;
+    }
+    try {
+        m->net = m->get_net(count);
+        m->forward(pool->x+(size_t)first*dims[0]);
+        m->compute_grads(pool->y+first);
+    } catch (error &e) {
+        printf("Intel(R) DNNL: worker %d failed!!!\n", index);
+        m->shared = false;
+    }
+}
+
+void* MLP::worker_main(void* arg){
+    WorkerArg* w = (WorkerArg*)arg;
+    Pool* p = w->master->pool;
+    omp_set_num_threads(p->omp_threads);
+    int seen = 0;
+    sgx_thread_mutex_lock(&p->lock);
+    while(true){
+        while(p->generation == seen && !p->stopping){
+            sgx_thread_cond_wait(&p->start, &p->lock);
+        }
+        if(p->stopping){
+            break;
+        }
+        seen = p->generation;
+        sgx_thread_mutex_unlock(&p->lock);
+        if(p->hogwild){
+            w->master->run_hogwild(w->index);
+        }else{
+            w->master->run_share(w->index);
+        }
+        sgx_thread_mutex_lock(&p->lock);
+        if(--p->pending == 0){
+            sgx_thread_cond_signal(&p->done);
+        }
+    }
+    sgx_thread_mutex_unlock(&p->lock);
+    delete w;
+    return NULL;
+}
+
+//synchronous data parallel training on num threads: every batch is split into num shares, each
+//share's gradient sums are computed on its own thread, summed into grads and applied in one step.
+//one thread (the default) trains as before; call it outside train, it joins the old workers
+void MLP::set_workers(int num){
+    if(pool != NULL){
+        sgx_thread_mutex_lock(&pool->lock);
+        pool->stopping = 1;
+        sgx_thread_cond_broadcast(&pool->start);
+        sgx_thread_mutex_unlock(&pool->lock);
+        for(size_t i=0; i<pool->threads.size(); i++){
+            pthread_join(pool->threads[i], NULL);
+        }
+        for(size_t i=0; i<pool->replicas.size(); i++){
+            delete pool->replicas[i];
+        }
+        delete pool;
+        pool = NULL;
+        keep = 0;
+    }
+    if(num <= 1){
+        return;
+    }
+    pool = new Pool();
+    pool->generation = 0;
+    pool->pending = 0;
+    pool->stopping = 0;
+    pool->omp_threads = omp_get_max_threads()/num > 1 ? omp_get_max_threads()/num : 1;
+    for(int i=1; i<num; i++){
+        pool->replicas.push_back(new MLP(this, (batch+num-1)/num));
+    }
+    for(int i=1; i<num; i++){
+        pthread_t thread;
+        WorkerArg* w = new WorkerArg();
+        w->master = this;
+        w->index = i;
+        if(pthread_create(&thread, NULL, worker_main, w) != 0){
+            printf("can not start training worker %d, an enclave TCS is missing\n", i);
+            delete w;
+            break;
+        }
+        pool->threads.push_back(thread);
+    }
+    //a share without a thread would never run
+    while(pool->replicas.size() > pool->threads.size()){
+        delete pool->replicas.back();
+        pool->replicas.pop_back();
+    }
+    //the master runs share 0 of every batch and share 0 of a tail batch, without keeping its full
+    //share net both would be rebuilt in every epoch
+    int t = pool->threads.size()+1;
+    keep = (batch+t-1)/t;
+    printf("training on %d threads with %d DNNL threads each\n", (int)pool->threads.size()+1, pool->omp_threads);
+}
 
-    // printf("fc2 src diff is %f\n", ((float*)net_bwd_args.at(6)[DNNL_ARG_DIFF_SRC].get_data_handle())[0]);
+//one step of the pool on n rows: shares in parallel, then the all-reduce and a single update
+void MLP::parallel_step(const float* x, const float* y, int n){
+    int t = pool->replicas.size()+1;
+    int old_threads = omp_get_max_threads();
+    omp_set_num_threads(pool->omp_threads);
+    sgx_thread_mutex_lock(&pool->lock);
+    pool->x = x;
+    pool->y = y;
+    pool->n = n;
+    pool->part = (n+t-1)/t;
+    pool->hogwild = false;
+    pool->pending = t-1;
+    pool->generation++;
+    sgx_thread_cond_broadcast(&pool->start);
+    sgx_thread_mutex_unlock(&pool->lock);
+    run_share(0);
+    sgx_thread_mutex_lock(&pool->lock);
+    while(pool->pending > 0){
+        sgx_thread_cond_wait(&pool->done, &pool->lock);
+    }
+    sgx_thread_mutex_unlock(&pool->lock);
+    omp_set_num_threads(old_threads);
 
-    read_from_dnnl_memory(fc1_user_diff_weights_buffer.data(),
-            fc1_user_diff_weights_memory);
-    read_from_dnnl_memory(fc1_diff_bias_buffer.data(), fc1_diff_bias_memory);
-    read_from_dnnl_memory(fc2_user_diff_weights_buffer.data(),
-            fc2_user_diff_weights_memory);
-    read_from_dnnl_memory(fc2_diff_bias_buffer.data(), fc2_diff_bias_memory);
+    //the shares' batch sums add up to the sum over the whole batch
+    if(!shared){
+        memset(grads, 0, param_count*sizeof(float));
+    }
+    for(int i=0; i<t-1; i++){
+        if(pool->replicas[i]->shared){
+            grad_accumulate(grads, pool->replicas[i]->grads, param_count);
+        }
+    }
+    optimizer_step(opt, params, grads, state, param_count, 1.0f/n, ++steps);
+}
 
-    for(int i=0; i<fc1_weights.size(); i++){
-        fc1_weights[i]-=alpha*fc1_user_diff_weights_buffer[i]/batch;
+//Hogwild: rows [index*size/t, (index+1)*size/t) of the epoch's order in batches of batch/t, every
+//batch updates the shared params and optimizer state right away and without locks. updates of
+//different threads interleave, so the result depends on timing, unlike the synchronous mode
+void MLP::run_hogwild(int index){
+    int t = pool->replicas.size()+1;
+    MLP* m = index == 0 ? this : pool->replicas[index-1];
+    int b = (batch+t-1)/t;
+    int first = (long)pool->n*index/t;
+    int last = (long)pool->n*(index+1)/t;
+    m->batch_x.resize((size_t)b*dims[0]);
+    m->batch_y.resize(b);
+    for(int j=first; j<last; j+=b){
+        int n = j+b<last?b:last-j;
+        for(int k=0; k<n; k++){
+            memcpy(&m->batch_x[(size_t)k*dims[0]], pool->data+(size_t)pool->order[j+k]*dims[0], dims[0]*sizeof(float));
+            m->batch_y[k] = pool->label[pool->order[j+k]];
+        }
+        try {
+            m->net = m->get_net(n);
+            m->forward(m->batch_x.data());
+            m->compute_grads(m->batch_y.data());
+        } catch (error &e) {
+            printf("Intel(R) DNNL: worker %d failed!!!\n", index);
+            continue;
+        }
+        optimizer_step(opt, params, m->grads, state, param_count, 1.0f/n, __sync_add_and_fetch(&steps, 1));
     }
-    for(int i=0; i<fc1_bias.size(); i++){
-        fc1_bias[i]-=alpha*fc1_diff_bias_buffer[i]/batch;
+}
+
+//one Hogwild epoch over order[0..size), all threads of the pool
+void MLP::hogwild_epoch(const float* data, const float* label, int size){
+    int t = pool->replicas.size()+1;
+    int old_threads = omp_get_max_threads();
+    omp_set_num_threads(pool->omp_threads);
+    sgx_thread_mutex_lock(&pool->lock);
+    pool->data = data;
+    pool->label = label;
+    pool->order = order.data();
+    pool->n = size;
+    pool->hogwild = true;
+    pool->pending = t-1;
+    pool->generation++;
+    sgx_thread_cond_broadcast(&pool->start);
+    sgx_thread_mutex_unlock(&pool->lock);
+    run_hogwild(0);
+    sgx_thread_mutex_lock(&pool->lock);
+    while(pool->pending > 0){
+        sgx_thread_cond_wait(&pool->done, &pool->lock);
     }
-    for(int i=0; i<fc2_weights.size(); i++){
-        fc2_weights[i]-=alpha*fc2_user_diff_weights_buffer[i]/batch;
+    sgx_thread_mutex_unlock(&pool->lock);
+    omp_set_num_threads(old_threads);
+}
+
+//asynchronous training on the threads of set_workers, only has an effect with more than one
+void MLP::set_async(int enable){
+    async = enable != 0;
+}
+
+//one step on n rows read in place from x and y, a short tail batch uses the cached net of its size
+void MLP::train_batch(const float* x, const float* y, int n){
+    if(pool != NULL){
+        parallel_step(x, y, n);
+        return;
     }
-    for(int i=0; i<fc2_bias.size(); i++){
-        fc2_bias[i]-=alpha*fc2_diff_bias_buffer[i]/batch;
+    try {
+        net = get_net(n);
+        forward(x);
+        backward(y);
+        // printf("Intel(R) DNNL: cnn_inference_f32.cpp: passed\n");
+    } catch (error &e) {
+        // printf("%x\n", e);
+        printf("Intel(R) DNNL: cnn_inference_f32.cpp: failed!!!\n");
     }
-    // printf("%f\n", fc1_weights[0]);
 }
 
+//splitmix64, the shuffle of a seed is the same on every machine
+static inline uint64_t shuffle_next(uint64_t* state){
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+//every epoch walks a Fisher-Yates permutation of the row indices drawn from model->seed, the
+//rows of a batch are gathered into one buffer, so the same seed and rows give the same checkpoint
+//(except in async mode). the mean loss of every epoch is kept in losses()
 void MLP::train(float* data, float* label, int epoch, int size, Model* model){
-    //current no shuffle, shuffle use twice much space
     // printf("size is %d\n", size);
-    int temp = batch;
+    order.resize(size);
+    for(int i=0; i<size; i++){
+        order[i] = i;
+    }
+    batch_x.resize((size_t)batch*dims[0]);
+    batch_y.resize(batch);
+    uint64_t rng = model->seed;
+    loss_curve.clear();
+#ifdef ALLOC_COUNT
+    size_t allocs = 0;
+    int full_steps = 0;
+#endif
     for(int i=0; i<epoch; i++){
-        for(int j=0; j<size; j+=batch){
-            int start = j;
-            int end = j+batch<size?j+batch:size;
-            batch = end-start;
-            // printf("start is %d, end is %d\n", start, end);
-            vector<float>input(data+start*network[0], data+end*network[0]);
-            // printf("label is %f\n", *(label+end-1));
-            vector<float>output(label+start, label+end);
-			
-			//deal with batch size different or directly discard
-			if(batch != temp){
-				int arch[3] = {600, 128, 1};
-				MLP another = MLP(arch, alpha, batch);
-				saveModel(model);
-				another.setModel(model);
-				another.forward(input);
-                another.backward(output);
-				another.saveModel(model);
-				setModel(model);
-				batch = temp;
-				continue;
-			}
-            try {
-                forward(input);
-                backward(output);
-                // printf("Intel(R) DNNL: cnn_inference_f32.cpp: passed\n");
-            } catch (error &e) {
-                // printf("%x\n", e);
-                printf("Intel(R) DNNL: cnn_inference_f32.cpp: failed!!!\n");
+        for(int j=size-1; j>0; j--){
+            std::swap(order[j], order[shuffle_next(&rng)%(j+1)]);
+        }
+        loss_sum = 0;
+        for(size_t j=0; pool != NULL && j<pool->replicas.size(); j++){
+            pool->replicas[j]->loss_sum = 0;
+        }
+        if(async && pool != NULL){
+            hogwild_epoch(data, label, size);
+        }else{
+            for(int j=0; j<size; j+=batch){
+                int n = j+batch<size?batch:size-j;
+                for(int k=0; k<n; k++){
+                    memcpy(&batch_x[(size_t)k*dims[0]], data+(size_t)order[j+k]*dims[0], dims[0]*sizeof(float));
+                    batch_y[k] = label[order[j+k]];
+                }
+#ifdef ALLOC_COUNT
+                size_t before = allocation_count();
+                train_batch(batch_x.data(), batch_y.data(), n);
+                if(n == batch){
+                    allocs += allocation_count()-before;
+                    full_steps++;
+                }
+#else
+                train_batch(batch_x.data(), batch_y.data(), n);
+#endif
             }
-            batch = temp;
         }
+        //mean training loss of the epoch, summed over the threads that saw its rows
+        double total = loss_sum;
+        for(size_t j=0; pool != NULL && j<pool->replicas.size(); j++){
+            total += pool->replicas[j]->loss_sum;
+        }
+        loss_curve.push_back(size > 0 ? (float)(total/size) : 0.0f);
+    }
+#ifdef ALLOC_COUNT
+    printf("%d full batch steps made %d heap allocations\n", full_steps, (int)allocs);
+#endif
+}
+
+//checkpoints keep plain {out, in} weights, so their hashes do not depend on the layouts DNNL
+//picked on this machine; the reorders happen here and nowhere in the training steps
+void MLP::convert(float* plain, float* blocked, bool to_blocked){
+    size_t offset = 0;
+    int k = 0;
+    for(size_t i=0; i<layers.size(); i++){
+        if(layers[i].units == 0){
+            continue;
+        }
+        memory::dims weights_tz = {dims[k+1], dims[k]};
+        memory p({{weights_tz}, dt::f32, tag::nc}, eng, plain+offset);
+        memory b(user_weights[i].get_desc(), eng, blocked+weights_offset[i]);
+        if(to_blocked){
+            reorder(p, b).execute(s, p, b);
+        }else{
+            reorder(b, p).execute(s, b, p);
+        }
+        offset += (size_t)dims[k]*dims[k+1];
+        if(to_blocked){
+            memcpy(blocked+bias_offset[i], plain+offset, dims[k+1]*sizeof(float));
+        }else{
+            memcpy(plain+offset, blocked+bias_offset[i], dims[k+1]*sizeof(float));
+        }
+        offset += dims[k+1];
+        k++;
     }
+    s.wait();
 }
 
 void MLP::setModel(Model* model){
-    fc1_weights = vector<float>(model->fc1w, model->fc1b);
-    fc1_bias = vector<float>(model->fc1b, model->fc2w);
-    fc2_weights = vector<float>(model->fc2w, model->fc2b);
-    fc2_bias = vector<float>(model->fc2b, model->fc2b+network[2]);
+    convert(model->storage, params, true);
+    int count = optimizer_state_count(opt.kind);
+    if(count > 0){
+        if(model->state_size == (int)(count*plain_count*sizeof(float))){
+            for(int i=0; i<count; i++){
+                convert(model->state+i*plain_count, state+i*param_count, true);
+            }
+        }else{
+            memset(state, 0, count*param_count*sizeof(float));
+        }
+    }
+    steps = model->step;
 }
 void MLP::saveModel(Model* model){
-    memcpy(model->fc1w, fc1_weights.data(), fc1_weights.size()*sizeof(float));
-    memcpy(model->fc1b, fc1_bias.data(), fc1_bias.size()*sizeof(float));
-    memcpy(model->fc2w, fc2_weights.data(), fc2_weights.size()*sizeof(float));
-    memcpy(model->fc2b, fc2_bias.data(), fc2_bias.size()*sizeof(float));
+    convert(model->storage, params, false);
+    int count = optimizer_state_count(opt.kind);
+    if(count > 0 && model->state_size == (int)(count*plain_count*sizeof(float))){
+        for(int i=0; i<count; i++){
+            convert(model->state+i*plain_count, state+i*param_count, false);
+        }
+    }
+    model->step = steps;
 }
 
+//runs in chunks of at most batch rows, so inference never needs more workspace than training
 vector<float> MLP::inference(vector<float>& input){
-    int temp = batch;
-    batch = input.size()/network[0];
-    forward(input);
-    vector<float> result(batch);
-    for(int i=0; i<batch; i++){
-        result[i] = user_dst[i]>0.5f?1.0f:0.0f;
-    }
-    // printf("result is %f %f\n", user_dst[0], user_dst[1]);
-    batch = temp;
+    int n = input.size()/dims[0];
+    vector<float> result(n);
+    for(int i=0; i<n; i+=batch){
+        int m = i+batch<n?batch:n-i;
+        net = get_net(m);
+        forward(input.data()+(size_t)i*dims[0]);
+        const float* user_dst = (const float*)net->out_memory.get_data_handle();
+        if(layers.back().softmax){
+            //the predicted class index, comparable with the labels
+            argmax_rows(user_dst, m, dims.back(), result.data()+i);
+            continue;
+        }
+        for(int j=0; j<m; j++){
+            result[i+j] = user_dst[j]>0.5f?1.0f:0.0f;
+        }
+    }
     return result; 
 }
\ No newline at end of file
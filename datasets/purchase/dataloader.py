@@ -1,10 +1,14 @@
 import numpy as np
 import os
+import hashlib
+import struct
 
 pwd = os.path.dirname(os.path.realpath(__file__))
 
-train_data = np.load(os.path.join(pwd, 'purchase2_train.npy'), allow_pickle=True)
-test_data = np.load(os.path.join(pwd, 'purchase2_test.npy'), allow_pickle=True)
+# the split of prepare_data.py with PURCHASE_CLASSES classes, 2 by default
+num_class = int(os.environ.get('PURCHASE_CLASSES', '2'))
+train_data = np.load(os.path.join(pwd, f'purchase{num_class}_train.npy'), allow_pickle=True)
+test_data = np.load(os.path.join(pwd, f'purchase{num_class}_test.npy'), allow_pickle=True)
 
 train_data = train_data.reshape((1,))[0]
 test_data = test_data.reshape((1,))[0]
@@ -20,6 +24,35 @@ def load(indices, category='train'):
     elif category == 'test':
         return X_test[indices], y_test[indices]
 
+def save_raw(path, data, label):
+    # raw float32 layout read by load_data_file: all rows, then all labels
+    with open(path, 'wb') as f:
+        f.write(np.ascontiguousarray(data, dtype=np.float32).tobytes())
+        f.write(np.ascontiguousarray(label, dtype=np.float32).tobytes())
+
+def save_chunked(path, data, label, chunk_rows=256, codec='raw'):
+    # chunked layout of include/dataset_format.h: header, chunk table, then per chunk rows followed by labels
+    # codec='lz4' stores every payload as one LZ4 block (needs the lz4 package)
+    data = np.ascontiguousarray(data, dtype=np.float32).reshape((len(label), -1))
+    label = np.ascontiguousarray(label, dtype=np.float32)
+    rows, cols = data.shape
+    num_chunks = (rows + chunk_rows - 1) // chunk_rows
+    payloads = [data[i:i+chunk_rows].tobytes() + label[i:i+chunk_rows].tobytes() for i in range(0, rows, chunk_rows)]
+    if codec == 'lz4':
+        import lz4.block
+        payloads = [lz4.block.compress(p, store_size=False) for p in payloads]
+    hashes = [hashlib.sha256(p).digest() for p in payloads]
+    root = hashlib.sha256(b''.join(hashes)).digest()
+    offset = 72 + 48 * num_chunks
+    with open(path, 'wb') as f:
+        f.write(struct.pack('<IIQIIIIQ32s', 0x54534455, 1, rows, cols, 0, 1 if codec == 'lz4' else 0, chunk_rows, num_chunks, root))
+        for p, h in zip(payloads, hashes):
+            f.write(struct.pack('<QQ32s', offset, len(p), h))
+            offset += len(p)
+        for p in payloads:
+            f.write(p)
+    return root.hex()
+
 
 if __name__ == "__main__":
     print(X_train.shape)
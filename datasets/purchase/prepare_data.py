@@ -1,4 +1,5 @@
 import os
+import sys
 import numpy as np
 from sklearn.cluster import KMeans
 from sklearn.model_selection import train_test_split
@@ -7,7 +8,8 @@ from scipy.sparse import load_npz
 
 data = np.concatenate([load_npz('data1.npz').toarray(), load_npz('data2.npz').toarray()]).astype(int)
 
-num_class = 2
+# python3 prepare_data.py [num_class], 100 gives the purchase-100 task, train it with a k,softmax output
+num_class = int(sys.argv[1]) if len(sys.argv) > 1 else 2
 
 if not os.path.exists(f'{num_class}_kmeans.npy'):
     kmeans = KMeans(n_clusters=num_class, random_state=0).fit(data)
@@ -0,0 +1,198 @@
+// Synthetic purchase-like dataset generator, writes the chunked format of include/dataset_format.h
+//
+//   make generator
+//   ./datasets/synthetic/generate <out.udst> <rows> [--cols 600] [--density 0.05] [--classes 2]
+//                                 [--seed 1] [--chunk-rows 256] [--raw] [--kids 8]
+//
+// Every class has its own prototype: a per feature probability drawn around --density.
+// A row picks a class uniformly and sets feature j to 1 with the class probability, so the
+// label is the cluster the row was drawn from, like the KMeans labels of prepare_data.py.
+// The output is fixed by the arguments. Chunks are LZ4 compressed unless --raw is given.
+// The root is printed and written to <out>.root, the kids of --kids evenly spaced rows to
+// <out>.kids, so python/synthetic.py can pin the root and unlearn real rows.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <openssl/sha.h>
+
+#include "dataset_format.h"
+#include "lz4_block.h"
+#include "xxhash64.h"
+
+//splitmix64, fixed across platforms unlike the std distributions
+struct Rng{
+    uint64_t state;
+    uint64_t next(){
+        uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    }
+    double uniform(){
+        return (next() >> 11) * (1.0/9007199254740992.0);
+    }
+};
+
+void usage(const char* name){
+    printf("usage: %s <out> <rows> [--cols n] [--density p] [--classes k] [--seed s] [--chunk-rows n] [--raw] [--kids n]\n", name);
+    exit(1);
+}
+
+int main(int argc, char** argv){
+    if(argc < 3){
+        usage(argv[0]);
+    }
+    const char* path = argv[1];
+    uint64_t rows = strtoull(argv[2], NULL, 10);
+    uint32_t cols = 600;
+    double density = 0.05;
+    int classes = 2;
+    uint64_t seed = 1;
+    uint32_t chunk_rows = 256;
+    uint32_t codec = DATASET_CODEC_LZ4;
+    int num_kids = 8;
+    for(int i=3; i<argc; i++){
+        std::string arg = argv[i];
+        if(arg == "--raw"){
+            codec = DATASET_CODEC_RAW;
+        }else if(i+1 >= argc){
+            usage(argv[0]);
+        }else if(arg == "--cols"){
+            cols = atoi(argv[++i]);
+        }else if(arg == "--density"){
+            density = atof(argv[++i]);
+        }else if(arg == "--classes"){
+            classes = atoi(argv[++i]);
+        }else if(arg == "--seed"){
+            seed = strtoull(argv[++i], NULL, 10);
+        }else if(arg == "--chunk-rows"){
+            chunk_rows = atoi(argv[++i]);
+        }else if(arg == "--kids"){
+            num_kids = atoi(argv[++i]);
+        }else{
+            usage(argv[0]);
+        }
+    }
+    if(rows == 0 || cols == 0 || classes < 1 || chunk_rows == 0 || density <= 0 || density >= 1){
+        usage(argv[0]);
+    }
+
+    //class prototypes, features are set with probability in [0, 2*density) around the class mean
+    Rng rng = {seed};
+    std::vector<uint16_t> threshold((size_t)classes*cols);
+    for(size_t i=0; i<threshold.size(); i++){
+        double p = 2*density*rng.uniform();
+        threshold[i] = (uint16_t)(p >= 1 ? 65535 : p*65536);
+    }
+
+    dataset_header_t header;
+    memset(&header, 0, sizeof(header));
+    header.magic = DATASET_MAGIC;
+    header.version = DATASET_VERSION;
+    header.rows = rows;
+    header.cols = cols;
+    header.dtype = DATASET_DTYPE_F32;
+    header.codec = codec;
+    header.chunk_rows = chunk_rows;
+    header.num_chunks = (rows+chunk_rows-1)/chunk_rows;
+    std::vector<dataset_chunk_t> chunks(header.num_chunks);
+
+    FILE* out = fopen(path, "wb");
+    if(out == NULL){
+        printf("Error: can not open %s\n", path);
+        return 1;
+    }
+    //header and table are rewritten once the chunk hashes are known
+    fwrite(&header, sizeof(header), 1, out);
+    fwrite(chunks.data(), sizeof(dataset_chunk_t), chunks.size(), out);
+    uint64_t offset = sizeof(header)+chunks.size()*sizeof(dataset_chunk_t);
+
+    uint64_t kid_step = num_kids > 0 ? (rows+num_kids-1)/num_kids : 0;
+    std::vector<uint64_t> kids;
+    size_t raw_bytes = (size_t)chunk_rows*(cols+1)*sizeof(float);
+    std::vector<float> payload(raw_bytes/sizeof(float));
+    std::vector<uint8_t> compressed(LZ4_BLOCK_BOUND(raw_bytes));
+    std::vector<float> hashed(cols+1);
+    uint64_t stored_bytes = 0;
+    for(uint64_t index=0; index<header.num_chunks; index++){
+        uint64_t n = dataset_chunk_rows(&header, index);
+        float* data = payload.data();
+        float* label = data+n*cols;
+        for(uint64_t i=0; i<n; i++){
+            int k = (int)(rng.next()%classes);
+            const uint16_t* t = &threshold[(size_t)k*cols];
+            float* row = data+i*cols;
+            //four 16 bit draws per 64 bit random number
+            uint64_t bits = 0;
+            for(uint32_t j=0; j<cols; j++){
+                if((j & 3) == 0){
+                    bits = rng.next();
+                }
+                row[j] = (uint16_t)bits < t[j] ? 1.0f : 0.0f;
+                bits >>= 16;
+            }
+            label[i] = (float)k;
+            uint64_t r = index*chunk_rows+i;
+            if(kid_step > 0 && r%kid_step == 0){
+                memcpy(hashed.data(), row, cols*sizeof(float));
+                hashed[cols] = label[i];
+                kids.push_back(XXHash64::hash(hashed.data(), (cols+1)*sizeof(float), 1));
+            }
+        }
+        const uint8_t* stored = (const uint8_t*)payload.data();
+        size_t size = n*(cols+1)*sizeof(float);
+        if(codec == DATASET_CODEC_LZ4){
+            size = lz4_block::compress(stored, size, compressed.data());
+            stored = compressed.data();
+        }
+        chunks[index].offset = offset;
+        chunks[index].size = size;
+        SHA256(stored, size, chunks[index].hash);
+        fwrite(stored, 1, size, out);
+        offset += size;
+        stored_bytes += size;
+        if(index%4096 == 4095){
+            printf("%llu / %llu rows\n", (unsigned long long)((index+1)*chunk_rows), (unsigned long long)rows);
+        }
+    }
+
+    SHA256_CTX sha256;
+    SHA256_Init(&sha256);
+    for(size_t i=0; i<chunks.size(); i++){
+        SHA256_Update(&sha256, chunks[i].hash, DATASET_HASH_LENGTH);
+    }
+    SHA256_Final(header.root, &sha256);
+    fseek(out, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, out);
+    fwrite(chunks.data(), sizeof(dataset_chunk_t), chunks.size(), out);
+    if(fclose(out) != 0){
+        printf("Error: can not write %s\n", path);
+        return 1;
+    }
+
+    char root[2*DATASET_HASH_LENGTH+1];
+    for(unsigned i=0; i<DATASET_HASH_LENGTH; i++){
+        sprintf(root+2*i, "%02x", header.root[i]);
+    }
+    std::string side = path;
+    FILE* f = fopen((side+".root").c_str(), "w");
+    if(f != NULL){
+        fprintf(f, "%s\n", root);
+        fclose(f);
+    }
+    f = fopen((side+".kids").c_str(), "w");
+    if(f != NULL){
+        for(size_t i=0; i<kids.size(); i++){
+            fprintf(f, "%llu\n", (unsigned long long)kids[i]);
+        }
+        fclose(f);
+    }
+    printf("wrote %llu rows of %u features in %llu chunks to %s, %.1f MB stored (%.1f MB raw)\n",
+        (unsigned long long)rows, cols, (unsigned long long)header.num_chunks, path,
+        stored_bytes/1e6, rows*(cols+1)*sizeof(float)/1e6);
+    printf("dataset root %s\n", root);
+    return 0;
+}
@@ -2,25 +2,28 @@
 #define DATA_STRUCTURE_HPP
 
 
+//network is the input size then the width of every inner product, storage holds
+//for each of them its weights {out, in} followed by its bias {out}, the MLP params layout
 class Model{
 public:
     int model_size;
     float* storage;
-    float* fc1w;
-    float* fc1b;
-    float* fc2w;
-    float* fc2b;
+    //optimizer state, state_count tensors with the storage layout, and the steps taken so far
+    int state_size;
+    float* state;
+    int step;
+    uint32_t seed; //shuffle seed of the epochs that trained this checkpoint, the init seed of checkpoint 0
     char* hash;
-    Model(int* network, int len){
+    Model(int* network, int len, int state_count){
         model_size = 0;
         for(int i=0; i< len-1; i++){
             model_size += (network[i]+1)*network[i+1]*sizeof(float);
         }
         storage = (float*)malloc(model_size);
-        fc1w = storage;
-        fc1b = fc1w+network[0]*network[1];
-        fc2w = fc1b+network[1];
-        fc2b = fc2w+network[1]*network[2];
+        state_size = state_count*model_size;
+        state = state_size > 0 ? (float*)calloc(1, state_size) : NULL;
+        step = 0;
+        seed = 0;
         hash = (char*)malloc(33);
     }
 };
@@ -0,0 +1,53 @@
+#ifndef DATASET_FORMAT_H
+#define DATASET_FORMAT_H
+
+#include <stdint.h>
+
+/*
+ * Chunked binary dataset file, read by the App and streamed into the enclave.
+ *
+ *   dataset_header_t | dataset_chunk_t[num_chunks] | chunk payloads
+ *
+ * Chunk i holds rows [i*chunk_rows, min((i+1)*chunk_rows, rows)). Its payload
+ * is the row values (row major) followed by one label per row, stored with
+ * the header codec. chunk.hash is the SHA-256 of the stored (compressed)
+ * payload bytes and header.root is the SHA-256 of all chunk hashes in order,
+ * so a trusted root authenticates every chunk.
+ */
+
+#define DATASET_MAGIC       0x54534455u /* "UDST" */
+#define DATASET_VERSION     1u
+#define DATASET_HASH_LENGTH 32u
+
+/* element type of row values and labels */
+#define DATASET_DTYPE_F32   0u
+
+/* payload encoding, an lz4 payload is one LZ4 block of the raw payload (see lz4_block.h) */
+#define DATASET_CODEC_RAW   0u
+#define DATASET_CODEC_LZ4   1u
+
+typedef struct _dataset_header_t {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t rows;
+    uint32_t cols;
+    uint32_t dtype;
+    uint32_t codec;
+    uint32_t chunk_rows;
+    uint64_t num_chunks;
+    uint8_t root[DATASET_HASH_LENGTH];
+} dataset_header_t;
+
+typedef struct _dataset_chunk_t {
+    uint64_t offset; /* payload offset from the start of the file */
+    uint64_t size;   /* stored payload bytes */
+    uint8_t hash[DATASET_HASH_LENGTH];
+} dataset_chunk_t;
+
+/* number of rows in chunk index */
+static inline uint64_t dataset_chunk_rows(const dataset_header_t* header, uint64_t index){
+    uint64_t first = index*header->chunk_rows;
+    return header->rows-first < header->chunk_rows ? header->rows-first : header->chunk_rows;
+}
+
+#endif
@@ -0,0 +1,172 @@
+#ifndef LZ4_BLOCK_H
+#define LZ4_BLOCK_H
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Header-only LZ4 block codec (raw blocks, no frame), byte compatible with
+ * LZ4_compress_default / LZ4_decompress_safe and python lz4.block with
+ * store_size=False. The enclave only decompresses, the generator compresses.
+ */
+
+/* worst case compressed size of n input bytes */
+#define LZ4_BLOCK_BOUND(n) ((n) + (n)/255 + 16)
+
+namespace lz4_block {
+
+const int min_match = 4;
+const int last_literals = 5; /* the last 5 bytes are always literals */
+const int mf_limit = 12;     /* a match can not start in the last 12 bytes */
+const int hash_log = 12;
+
+static inline uint32_t read32(const uint8_t* p){
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint32_t hash(uint32_t v){
+    return (v*2654435761u) >> (32-hash_log);
+}
+
+static inline uint8_t* write_length(uint8_t* op, size_t len){
+    while(len >= 255){
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+static inline uint8_t* write_sequence(uint8_t* op, const uint8_t* literals, size_t lit, size_t offset, size_t mlen){
+    uint8_t* token = op++;
+    *token = (uint8_t)((lit >= 15 ? 15 : lit) << 4);
+    if(lit >= 15){
+        op = write_length(op, lit-15);
+    }
+    memcpy(op, literals, lit);
+    op += lit;
+    if(offset == 0){
+        return op; /* last sequence, literals only */
+    }
+    *op++ = (uint8_t)(offset & 0xff);
+    *op++ = (uint8_t)(offset >> 8);
+    *token |= (uint8_t)(mlen >= 15 ? 15 : mlen);
+    if(mlen >= 15){
+        op = write_length(op, mlen-15);
+    }
+    return op;
+}
+
+/* greedy single pass compression, dst must hold LZ4_BLOCK_BOUND(size) bytes, returns the compressed size */
+static inline size_t compress(const uint8_t* src, size_t size, uint8_t* dst){
+    uint32_t table[1 << hash_log];
+    const uint8_t* ip = src;
+    const uint8_t* anchor = src;
+    const uint8_t* end = src+size;
+    uint8_t* op = dst;
+    if(size > (size_t)mf_limit){
+        const uint8_t* match_limit = end-last_literals;
+        const uint8_t* ip_limit = end-mf_limit;
+        memset(table, 0, sizeof(table));
+        ip++;
+        while(ip <= ip_limit){
+            uint32_t h = hash(read32(ip));
+            const uint8_t* ref = src+table[h];
+            table[h] = (uint32_t)(ip-src);
+            if(ip-ref > 65535 || read32(ref) != read32(ip)){
+                ip++;
+                continue;
+            }
+            while(ip > anchor && ref > src && ip[-1] == ref[-1]){
+                ip--;
+                ref--;
+            }
+            const uint8_t* mp = ip+min_match;
+            const uint8_t* rp = ref+min_match;
+            while(mp < match_limit && *mp == *rp){
+                mp++;
+                rp++;
+            }
+            op = write_sequence(op, anchor, ip-anchor, ip-ref, mp-ip-min_match);
+            ip = mp;
+            anchor = ip;
+            if(ip <= ip_limit){
+                table[hash(read32(ip-2))] = (uint32_t)(ip-2-src);
+            }
+        }
+    }
+    op = write_sequence(op, anchor, end-anchor, 0, 0);
+    return op-dst;
+}
+
+/* bounds checked decompression, returns the decompressed size or -1 when src is not a valid block for capacity bytes */
+static inline long decompress(const uint8_t* src, size_t size, uint8_t* dst, size_t capacity){
+    const uint8_t* ip = src;
+    const uint8_t* iend = src+size;
+    uint8_t* op = dst;
+    uint8_t* oend = dst+capacity;
+    while(ip < iend){
+        unsigned token = *ip++;
+        size_t lit = token >> 4;
+        if(lit == 15){
+            unsigned s;
+            do{
+                if(ip >= iend){
+                    return -1;
+                }
+                s = *ip++;
+                lit += s;
+            }while(s == 255);
+        }
+        if(lit > (size_t)(iend-ip) || lit > (size_t)(oend-op)){
+            return -1;
+        }
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if(ip == iend){
+            break;
+        }
+        if(iend-ip < 2){
+            return -1;
+        }
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if(offset == 0 || offset > (size_t)(op-dst)){
+            return -1;
+        }
+        size_t mlen = token & 15;
+        if(mlen == 15){
+            unsigned s;
+            do{
+                if(ip >= iend){
+                    return -1;
+                }
+                s = *ip++;
+                mlen += s;
+            }while(s == 255);
+        }
+        mlen += min_match;
+        if(mlen > (size_t)(oend-op)){
+            return -1;
+        }
+        //an overlapping match repeats the last offset bytes, copy the period in doubling pieces
+        const uint8_t* ref = op-offset;
+        uint8_t* mend = op+mlen;
+        while(op < mend){
+            size_t n = op-ref;
+            if(n > (size_t)(mend-op)){
+                n = mend-op;
+            }
+            memcpy(op, ref, n);
+            op += n;
+        }
+    }
+    return op-dst;
+}
+
+}
+
+#endif
@@ -0,0 +1,149 @@
+#ifndef OPTIMIZER_HPP
+#define OPTIMIZER_HPP
+
+#include <math.h>
+#include <stddef.h>
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+/*
+ * Fused parameter update over the whole parameter arena. params, grads and
+ * the state tensors share one layout, so every tensor of the net is updated
+ * in a single pass. grads are batch sums, scale turns them into means.
+ * AVX-512 / AVX2 paths follow the SGX_AVX build flag.
+ */
+
+#define OPTIMIZER_SGD      0
+#define OPTIMIZER_MOMENTUM 1
+#define OPTIMIZER_ADAM     2
+
+struct OptimizerConfig{
+    int kind;
+    float lr;
+    float momentum;
+    float beta1;
+    float beta2;
+    float eps;
+};
+
+//parameter sized state tensors kept in the checkpoint: momentum has the velocity, Adam both moments
+static inline int optimizer_state_count(int kind){
+    return kind == OPTIMIZER_ADAM ? 2 : kind == OPTIMIZER_MOMENTUM ? 1 : 0;
+}
+
+//p -= a*g
+static inline void sgd_update(float* p, const float* g, size_t n, float a){
+    size_t i = 0;
+#if defined(__AVX512F__)
+    __m512 va = _mm512_set1_ps(a);
+    for(; i+16<=n; i+=16){
+        _mm512_storeu_ps(p+i, _mm512_fnmadd_ps(va, _mm512_loadu_ps(g+i), _mm512_loadu_ps(p+i)));
+    }
+#elif defined(__AVX2__)
+    __m256 va = _mm256_set1_ps(a);
+    for(; i+8<=n; i+=8){
+        _mm256_storeu_ps(p+i, _mm256_sub_ps(_mm256_loadu_ps(p+i), _mm256_mul_ps(va, _mm256_loadu_ps(g+i))));
+    }
+#endif
+    for(; i<n; i++){
+        p[i] -= a*g[i];
+    }
+}
+
+//u = mu*u + s*g, p -= lr*u
+static inline void momentum_update(float* p, const float* g, float* u, size_t n, float lr, float mu, float s){
+    size_t i = 0;
+#if defined(__AVX512F__)
+    __m512 vlr = _mm512_set1_ps(lr), vmu = _mm512_set1_ps(mu), vs = _mm512_set1_ps(s);
+    for(; i+16<=n; i+=16){
+        __m512 vu = _mm512_fmadd_ps(vmu, _mm512_loadu_ps(u+i), _mm512_mul_ps(vs, _mm512_loadu_ps(g+i)));
+        _mm512_storeu_ps(u+i, vu);
+        _mm512_storeu_ps(p+i, _mm512_fnmadd_ps(vlr, vu, _mm512_loadu_ps(p+i)));
+    }
+#elif defined(__AVX2__)
+    __m256 vlr = _mm256_set1_ps(lr), vmu = _mm256_set1_ps(mu), vs = _mm256_set1_ps(s);
+    for(; i+8<=n; i+=8){
+        __m256 vu = _mm256_add_ps(_mm256_mul_ps(vmu, _mm256_loadu_ps(u+i)), _mm256_mul_ps(vs, _mm256_loadu_ps(g+i)));
+        _mm256_storeu_ps(u+i, vu);
+        _mm256_storeu_ps(p+i, _mm256_sub_ps(_mm256_loadu_ps(p+i), _mm256_mul_ps(vlr, vu)));
+    }
+#endif
+    for(; i<n; i++){
+        u[i] = mu*u[i]+s*g[i];
+        p[i] -= lr*u[i];
+    }
+}
+
+//m = b1*m + (1-b1)*s*g, v = b2*v + (1-b2)*(s*g)^2, p -= a*m/(sqrt(v)+e)
+//a and e already carry the bias correction of step t
+static inline void adam_update(float* p, const float* g, float* m, float* v, size_t n,
+        float a, float b1, float b2, float e, float s){
+    size_t i = 0;
+#if defined(__AVX512F__)
+    __m512 va = _mm512_set1_ps(a), vb1 = _mm512_set1_ps(b1), vb2 = _mm512_set1_ps(b2), ve = _mm512_set1_ps(e), vs = _mm512_set1_ps(s);
+    __m512 vc1 = _mm512_set1_ps(1-b1), vc2 = _mm512_set1_ps(1-b2);
+    for(; i+16<=n; i+=16){
+        __m512 vg = _mm512_mul_ps(vs, _mm512_loadu_ps(g+i));
+        __m512 vm = _mm512_fmadd_ps(vb1, _mm512_loadu_ps(m+i), _mm512_mul_ps(vc1, vg));
+        __m512 vv = _mm512_fmadd_ps(vb2, _mm512_loadu_ps(v+i), _mm512_mul_ps(vc2, _mm512_mul_ps(vg, vg)));
+        _mm512_storeu_ps(m+i, vm);
+        _mm512_storeu_ps(v+i, vv);
+        __m512 vd = _mm512_div_ps(vm, _mm512_add_ps(_mm512_sqrt_ps(vv), ve));
+        _mm512_storeu_ps(p+i, _mm512_fnmadd_ps(va, vd, _mm512_loadu_ps(p+i)));
+    }
+#elif defined(__AVX2__)
+    __m256 va = _mm256_set1_ps(a), vb1 = _mm256_set1_ps(b1), vb2 = _mm256_set1_ps(b2), ve = _mm256_set1_ps(e), vs = _mm256_set1_ps(s);
+    __m256 vc1 = _mm256_set1_ps(1-b1), vc2 = _mm256_set1_ps(1-b2);
+    for(; i+8<=n; i+=8){
+        __m256 vg = _mm256_mul_ps(vs, _mm256_loadu_ps(g+i));
+        __m256 vm = _mm256_add_ps(_mm256_mul_ps(vb1, _mm256_loadu_ps(m+i)), _mm256_mul_ps(vc1, vg));
+        __m256 vv = _mm256_add_ps(_mm256_mul_ps(vb2, _mm256_loadu_ps(v+i)), _mm256_mul_ps(vc2, _mm256_mul_ps(vg, vg)));
+        _mm256_storeu_ps(m+i, vm);
+        _mm256_storeu_ps(v+i, vv);
+        __m256 vd = _mm256_div_ps(vm, _mm256_add_ps(_mm256_sqrt_ps(vv), ve));
+        _mm256_storeu_ps(p+i, _mm256_sub_ps(_mm256_loadu_ps(p+i), _mm256_mul_ps(va, vd)));
+    }
+#endif
+    for(; i<n; i++){
+        float gi = s*g[i];
+        m[i] = b1*m[i]+(1-b1)*gi;
+        v[i] = b2*v[i]+(1-b2)*gi*gi;
+        p[i] -= a*m[i]/(sqrtf(v[i])+e);
+    }
+}
+
+//dst += src, the all-reduce of data parallel gradients
+static inline void grad_accumulate(float* dst, const float* src, size_t n){
+    size_t i = 0;
+#if defined(__AVX512F__)
+    for(; i+16<=n; i+=16){
+        _mm512_storeu_ps(dst+i, _mm512_add_ps(_mm512_loadu_ps(dst+i), _mm512_loadu_ps(src+i)));
+    }
+#elif defined(__AVX2__)
+    for(; i+8<=n; i+=8){
+        _mm256_storeu_ps(dst+i, _mm256_add_ps(_mm256_loadu_ps(dst+i), _mm256_loadu_ps(src+i)));
+    }
+#endif
+    for(; i<n; i++){
+        dst[i] += src[i];
+    }
+}
+
+//one step of opt, state holds optimizer_state_count(opt.kind) tensors of n floats, t counts steps from 1
+static inline void optimizer_step(const OptimizerConfig& opt, float* params, const float* grads, float* state,
+        size_t n, float scale, int t){
+    if(opt.kind == OPTIMIZER_MOMENTUM){
+        momentum_update(params, grads, state, n, opt.lr, opt.momentum, scale);
+    }else if(opt.kind == OPTIMIZER_ADAM){
+        double c1 = 1-pow((double)opt.beta1, t);
+        double c2 = sqrt(1-pow((double)opt.beta2, t));
+        adam_update(params, grads, state, state+n, n, (float)(opt.lr*c2/c1), opt.beta1, opt.beta2,
+            (float)(opt.eps*c2), scale);
+    }else{
+        sgd_update(params, grads, n, opt.lr*scale);
+    }
+}
+
+#endif
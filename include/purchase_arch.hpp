@@ -6,61 +6,139 @@
 #include <chrono>
 #include <numeric>
 #include <vector>
+#include <map>
 #include <unordered_map>
 
 #include "example_utils.hpp"
 #include "Enclave.h"
 #include "data_structure.hpp"
+#include "optimizer.hpp"
 
 using namespace dnnl;
 
 using namespace std;
 
+//one entry of the layer list: an inner product with units outputs, or an activation (units 0)
+struct LayerSpec{
+    int units;
+    algorithm activation;
+    bool softmax; //the softmax output over classes, activation is then undef
+};
+
+//parse a layer list like "128,tanh,1,sigmoid": numbers are inner products, names are activations
+//(relu, tanh, sigmoid, softmax); the list has to end with a single sigmoid output for binary labels
+//or with "k,softmax" (k >= 2) for class index labels 0..k-1. returns 0 when valid
+int parse_layers(const char* spec, vector<LayerSpec>& layers);
+
 class MLP{
     private:
-        int network[3];
-        float alpha;
+        vector<LayerSpec> layers;
+        vector<int> dims; //input size, then the outputs of every inner product, the Model network
+        OptimizerConfig opt;
+        float* state; //optimizer state arena, optimizer_state_count(opt.kind) copies of the params layout
+        float* state_raw;
+        int steps;
         engine eng;
         stream s;
         memory::dim batch;
-        vector<primitive> net_fwd;
-        vector<primitive> net_bwd;
-        vector<std::unordered_map<int, memory>> net_fwd_args;
-        vector<std::unordered_map<int, memory>> net_bwd_args;
-        vector<float> user_src;
-        memory user_src_memory;
-        vector<float> user_dst;
-        memory user_dst_memory;
-        vector<float> fc1_weights;
-        memory fc1_user_weights_memory;
-        vector<float> fc1_bias;
-        memory fc1_user_bias_memory;
-        vector<float> fc2_weights;
-        memory fc2_user_weights_memory;
-        vector<float> fc2_bias;
-        memory fc2_user_bias_memory;
-        vector<float> net_diff_dst;
-        memory fc2_user_diff_dst_memory;
-        vector<float> fc1_user_diff_weights_buffer;
-        memory fc1_user_diff_weights_memory;
-        vector<float> fc1_diff_bias_buffer;
-        memory fc1_diff_bias_memory;
-        vector<float> fc2_user_diff_weights_buffer;
-        memory fc2_user_diff_weights_memory;
-        vector<float> fc2_diff_bias_buffer;
-        memory fc2_diff_bias_memory;
+        bool bf16; //mixed precision: bf16 primitives on an fp32 master copy of the parameters
+        //primitives for one batch size, their buffers are planned into the shared workspace
+        struct Net{
+            memory::dim batch;
+            vector<primitive> fwd;
+            vector<primitive> bwd;
+            vector<std::unordered_map<int, memory>> fwd_args;
+            vector<std::unordered_map<int, memory>> bwd_args;
+            //the same arguments as C arrays for dnnl_primitive_execute, primitive::execute would
+            //convert the maps into a new vector on every call
+            vector<vector<dnnl_exec_arg_t>> fwd_exec;
+            vector<vector<dnnl_exec_arg_t>> bwd_exec;
+            memory src_memory; //bound to the caller's batch in forward
+            memory out_memory; //network output, nc
+            memory loss_diff_memory; //loss gradient wrt the output, nc
+            vector<std::pair<memory, size_t>> planned; //workspace memories and their offsets
+            size_t workspace_bytes;
+            size_t scratchpad_bytes; //largest scratchpad of its primitives, one shared copy is planned
+        };
+        std::map<memory::dim, Net*> nets; //keyed by batch size, the full batch, keep and at most one other
+        memory::dim keep; //share size of a full batch under set_workers, 0 without workers
+        Net* net; //the one forward/backward run
+        //parameters and their gradients, each one 64 byte aligned arena: for every inner product its
+        //weights in the layout the forward primitive picked (padding included) then its bias {out}.
+        //the optimizer runs on these blocked tensors, only checkpoints see the plain Model layout
+        size_t param_count;
+        size_t plain_count; //floats of one plain copy, Model::model_size/sizeof(float)
+        vector<size_t> weights_offset; //per layer offsets into the arenas
+        vector<size_t> bias_offset;
+        float* params;
+        float* params_raw;
+        float* grads;
+        float* grads_raw;
+        primitive_attr scratch; //user scratchpad mode, given to every primitive of a net
+        //activations, backward temporaries and scratchpads of every net, nets never run at the same time.
+        //sized by size_workspace when the MLP is built, grown by get_net if a net still needs more
+        float* workspace;
+        float* workspace_raw;
+        size_t workspace_size;
+        //shuffled row order of the current train call and the batch gathered from it
+        vector<int> order;
+        vector<float> batch_x;
+        vector<float> batch_y;
+        vector<memory> user_weights; //blocked views into params/grads per layer, empty for activations
+        vector<memory> user_bias;
+        vector<memory> user_diff_weights;
+        vector<memory> user_diff_bias;
+        //data parallel training, see set_workers
+        struct Pool;
+        Pool* pool;
+        bool shared; //this replica computed gradients for the current batch
+        bool async; //Hogwild epochs instead of synchronous steps, see set_async
+        double loss_sum; //BCE or cross entropy summed over the rows this MLP computed gradients for in the epoch
+        vector<float> loss_curve; //mean loss of every epoch of the last train call
+        MLP(const MLP&);
+        MLP& operator=(const MLP&);
+        MLP(MLP* master, int b);
+        void bind_params(const vector<memory::desc>& weights_md);
+        Net* get_net(memory::dim b);
+        Net* build_net(memory::dim b);
+        memory plan(Net* n, const memory::desc& d);
+        memory reorder_to(Net* n, vector<primitive>& prims, vector<std::unordered_map<int, memory>>& args,
+                const memory& from, const memory::desc& d);
+        void size_workspace();
+        void grow_workspace(size_t bytes);
+        void bind_workspace(Net* n);
+        void reserve_scratchpad(Net* n, const primitive_desc_base& pd);
+        void convert(float* plain, float* blocked, bool to_blocked);
+        void compute_grads(const float* target);
+        void run_share(int index);
+        void parallel_step(const float* x, const float* y, int n);
+        void run_hogwild(int index);
+        void hogwild_epoch(const float* data, const float* label, int size);
+        static void* worker_main(void* arg);
     public:
-        MLP(int arch[3], float a, int b);
-        void forward(const vector<float>& input);
-        void backward(const vector<float>& target);
+        MLP(const vector<LayerSpec>& l, int input_dim, float a, int b);
+        ~MLP();
+        void set_optimizer(int kind, float lr);
+        void set_precision(int enable);
+        void set_workers(int num);
+        void set_async(int enable);
+        void forward(const float* input);
+        void backward(const float* target);
+        void train_batch(const float* x, const float* y, int n);
         void train(float* data, float* label, int epoch, int size, Model* model);
         void setModel(Model* model);
         void saveModel(Model* model);
         vector<float> inference(vector<float>& input);
+        const vector<float>& losses(){
+            return loss_curve;
+        }
+        const vector<int>& network(){
+            return dims;
+        }
         static memory::dim product(const memory::dims &dims) {
             return std::accumulate(dims.begin(), dims.end(), (memory::dim)1,
                     std::multiplies<memory::dim>());
         }
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -6,6 +6,9 @@
 
 #pragma once
 #include <stdint.h> // for uint32_t and uint64_t
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
 
 /// XXHash (64 bit), based on Yann Collet's descriptions, see http://cyan4973.github.io/xxHash/
 /** How to use:
@@ -17,6 +20,8 @@
     uint64_t result = myhash.hash();
     // or all of the above in one single line:
     uint64_t result2 = XXHash64::hash(mypointer, numBytes, myseed);
+    // several inputs of the same length, hashed in SIMD lanes when AVX2/AVX-512 is enabled:
+    XXHash64::hashBatch(pointers, numInputs, numBytes, myseed, results);
     Note: my code is NOT endian-aware !
 **/
 class XXHash64
@@ -160,6 +165,31 @@ public:
       return hasher.hash();
   }
 
+  /// hash count inputs of equal length, results are bit-identical to hash()
+  /** @param  inputs  count pointers to continuous blocks of data
+      @param  count   number of inputs
+      @param  length  number of bytes of every input
+      @param  seed    your seed value, e.g. zero is a valid seed
+      @param  results receives count 64 bit XXHashes **/
+  static void hashBatch(const void* const* inputs, uint64_t count, uint64_t length, uint64_t seed, uint64_t* results)
+  {
+    uint64_t i = 0;
+    // lanes only help for the 32 byte blocks, shorter inputs stay scalar
+    if (length >= MaxBufferSize)
+    {
+#if defined(__AVX512F__) && defined(__AVX512DQ__)
+      for (; i + 8 <= count; i += 8)
+        hashLanes8(inputs + i, length, seed, results + i);
+#endif
+#if defined(__AVX2__)
+      for (; i + 4 <= count; i += 4)
+        hashLanes4(inputs + i, length, seed, results + i);
+#endif
+    }
+    for (; i < count; i++)
+      results[i] = hash(inputs[i], length, seed);
+  }
+
 private:
   /// magic constants :-)
   static const uint64_t Prime1 = 11400714785074694791ULL;
@@ -197,4 +227,128 @@ private:
     state2 = processSingle(state2, block[2]);
     state3 = processSingle(state3, block[3]);
   }
+
+  /// finish one lane: the remaining bytes go through the scalar hash()
+  static uint64_t finishLane(const uint64_t laneState[4], const void* input, uint64_t length, uint64_t seed)
+  {
+    XXHash64 hasher(seed);
+    for (int j = 0; j < 4; j++)
+      hasher.state[j] = laneState[j];
+    uint64_t blocks = length / MaxBufferSize * MaxBufferSize;
+    const unsigned char* data = (const unsigned char*)input + blocks;
+    hasher.bufferSize  = length - blocks;
+    hasher.totalLength = length;
+    for (uint64_t k = 0; k < hasher.bufferSize; k++)
+      hasher.buffer[k] = data[k];
+    return hasher.hash();
+  }
+
+#if defined(__AVX2__)
+  /// 64 bit multiply per lane, AVX2 only has 32x32 bit multiplies
+  static inline __m256i mul64x4(__m256i a, __m256i b)
+  {
+    __m256i low   = _mm256_mul_epu32(a, b);
+    __m256i cross = _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), b),
+                                     _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)));
+    return _mm256_add_epi64(low, _mm256_slli_epi64(cross, 32));
+  }
+
+  static inline __m256i processSingle4(__m256i previous, __m256i input)
+  {
+    const __m256i prime1 = _mm256_set1_epi64x((long long)Prime1);
+    const __m256i prime2 = _mm256_set1_epi64x((long long)Prime2);
+    __m256i x = _mm256_add_epi64(previous, mul64x4(input, prime2));
+    x = _mm256_or_si256(_mm256_slli_epi64(x, 31), _mm256_srli_epi64(x, 33));
+    return mul64x4(x, prime1);
+  }
+
+  /// 4 inputs side by side, lane k of state j is state[j] of input k
+  static void hashLanes4(const void* const* inputs, uint64_t length, uint64_t seed, uint64_t* results)
+  {
+    __m256i s0 = _mm256_set1_epi64x((long long)(seed + Prime1 + Prime2));
+    __m256i s1 = _mm256_set1_epi64x((long long)(seed + Prime2));
+    __m256i s2 = _mm256_set1_epi64x((long long)seed);
+    __m256i s3 = _mm256_set1_epi64x((long long)(seed - Prime1));
+    const unsigned char* p0 = (const unsigned char*)inputs[0];
+    const unsigned char* p1 = (const unsigned char*)inputs[1];
+    const unsigned char* p2 = (const unsigned char*)inputs[2];
+    const unsigned char* p3 = (const unsigned char*)inputs[3];
+    for (uint64_t offset = 0; offset + MaxBufferSize <= length; offset += MaxBufferSize)
+    {
+      __m256i r0 = _mm256_loadu_si256((const __m256i*)(p0 + offset));
+      __m256i r1 = _mm256_loadu_si256((const __m256i*)(p1 + offset));
+      __m256i r2 = _mm256_loadu_si256((const __m256i*)(p2 + offset));
+      __m256i r3 = _mm256_loadu_si256((const __m256i*)(p3 + offset));
+      // transpose 4x4 words so that block j of every input sits in one register
+      __m256i t0 = _mm256_unpacklo_epi64(r0, r1);
+      __m256i t1 = _mm256_unpackhi_epi64(r0, r1);
+      __m256i t2 = _mm256_unpacklo_epi64(r2, r3);
+      __m256i t3 = _mm256_unpackhi_epi64(r2, r3);
+      s0 = processSingle4(s0, _mm256_permute2x128_si256(t0, t2, 0x20));
+      s1 = processSingle4(s1, _mm256_permute2x128_si256(t1, t3, 0x20));
+      s2 = processSingle4(s2, _mm256_permute2x128_si256(t0, t2, 0x31));
+      s3 = processSingle4(s3, _mm256_permute2x128_si256(t1, t3, 0x31));
+    }
+    uint64_t lanes[4][4];
+    _mm256_storeu_si256((__m256i*)lanes[0], s0);
+    _mm256_storeu_si256((__m256i*)lanes[1], s1);
+    _mm256_storeu_si256((__m256i*)lanes[2], s2);
+    _mm256_storeu_si256((__m256i*)lanes[3], s3);
+    for (int k = 0; k < 4; k++)
+    {
+      uint64_t laneState[4] = { lanes[0][k], lanes[1][k], lanes[2][k], lanes[3][k] };
+      results[k] = finishLane(laneState, inputs[k], length, seed);
+    }
+  }
+#endif
+
+#if defined(__AVX512F__) && defined(__AVX512DQ__)
+  static inline __m512i processSingle8(__m512i previous, __m512i input)
+  {
+    const __m512i prime1 = _mm512_set1_epi64((long long)Prime1);
+    const __m512i prime2 = _mm512_set1_epi64((long long)Prime2);
+    __m512i x = _mm512_add_epi64(previous, _mm512_mullo_epi64(input, prime2));
+    return _mm512_mullo_epi64(_mm512_rol_epi64(x, 31), prime1);
+  }
+
+  /// 8 inputs side by side, lane k of state j is state[j] of input k
+  static void hashLanes8(const void* const* inputs, uint64_t length, uint64_t seed, uint64_t* results)
+  {
+    __m512i s0 = _mm512_set1_epi64((long long)(seed + Prime1 + Prime2));
+    __m512i s1 = _mm512_set1_epi64((long long)(seed + Prime2));
+    __m512i s2 = _mm512_set1_epi64((long long)seed);
+    __m512i s3 = _mm512_set1_epi64((long long)(seed - Prime1));
+    const unsigned char* p[8];
+    for (int k = 0; k < 8; k++)
+      p[k] = (const unsigned char*)inputs[k];
+    const __m512i even = _mm512_set_epi64(13, 12, 5, 4, 9, 8, 1, 0);
+    const __m512i odd  = _mm512_set_epi64(15, 14, 7, 6, 11, 10, 3, 2);
+    for (uint64_t offset = 0; offset + MaxBufferSize <= length; offset += MaxBufferSize)
+    {
+      // input k in the low half, input k+4 in the high half
+      __m512i z[4];
+      for (int k = 0; k < 4; k++)
+        z[k] = _mm512_inserti64x4(_mm512_castsi256_si512(_mm256_loadu_si256((const __m256i*)(p[k] + offset))),
+                                  _mm256_loadu_si256((const __m256i*)(p[k + 4] + offset)), 1);
+      __m512i t0 = _mm512_unpacklo_epi64(z[0], z[1]);
+      __m512i t1 = _mm512_unpackhi_epi64(z[0], z[1]);
+      __m512i t2 = _mm512_unpacklo_epi64(z[2], z[3]);
+      __m512i t3 = _mm512_unpackhi_epi64(z[2], z[3]);
+      s0 = processSingle8(s0, _mm512_permutex2var_epi64(t0, even, t2));
+      s1 = processSingle8(s1, _mm512_permutex2var_epi64(t1, even, t3));
+      s2 = processSingle8(s2, _mm512_permutex2var_epi64(t0, odd,  t2));
+      s3 = processSingle8(s3, _mm512_permutex2var_epi64(t1, odd,  t3));
+    }
+    uint64_t lanes[4][8];
+    _mm512_storeu_si512(lanes[0], s0);
+    _mm512_storeu_si512(lanes[1], s1);
+    _mm512_storeu_si512(lanes[2], s2);
+    _mm512_storeu_si512(lanes[3], s3);
+    for (int k = 0; k < 8; k++)
+    {
+      uint64_t laneState[4] = { lanes[0][k], lanes[1][k], lanes[2][k], lanes[3][k] };
+      results[k] = finishLane(laneState, inputs[k], length, seed);
+    }
+  }
+#endif
 };
\ No newline at end of file
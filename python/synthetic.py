@@ -0,0 +1,55 @@
+import sys
+import struct
+import time
+import ctypes
+from ctypes import *
+
+# usage: python3 python/synthetic.py <dataset.udst> [--lazy] [--recheck]
+# the dataset comes from `make generator && ./datasets/synthetic/generate <dataset.udst> <rows>`
+
+path = sys.argv[1]
+
+with open(path, 'rb') as f:
+    magic, version, r, c = struct.unpack('<IIQI', f.read(20))
+assert magic == 0x54534455, "not a chunked dataset file"
+root = open(path + '.root').read().strip()
+kids = [int(x) for x in open(path + '.kids').read().split()]
+
+ll = ctypes.cdll.LoadLibrary
+lib = ll("./App/app.so")
+
+lib.initialize_enclave.restype = c_uint32
+lib.initialize_enclave.argtypes = []
+lib.destroy_enclave.argtypes = []
+lib.load_data_file.argtypes = [c_char_p, c_uint32, c_uint32]
+lib.load_data_file.restype = c_int32
+lib.set_dataset_root.argtypes = [c_char_p]
+lib.set_dataset_root.restype = c_int32
+lib.set_lazy_index.argtypes = [c_int32]
+lib.set_digest_check.argtypes = [c_int32]
+lib.contains.argtypes = [c_uint64]
+lib.contains.restype = c_int32
+lib.unlearning.argtypes = [c_uint64]
+
+s = lib.initialize_enclave()
+
+print("dataset", path, (r, c), "root", root)
+lib.set_dataset_root(root.encode())
+if lib.load_data_file(path.encode(), r, c) != 0:
+    sys.exit(1)
+
+if "--lazy" in sys.argv:
+    lib.set_lazy_index(1)
+if "--recheck" in sys.argv:
+    lib.set_digest_check(1)
+
+start = time.time()
+lib.init_enclave_storage()
+print("ingestion and training need time", time.time()-start)
+
+for id in kids:
+    tick = time.time()
+    lib.unlearning(id)
+    print("unlearning", id, "need time", time.time()-tick, "still present", lib.contains(id))
+
+lib.destroy_enclave()
@@ -1,5 +1,9 @@
+import os
 import sys
 sys.path.append('./datasets/purchase')
+if "--classes" in sys.argv:
+    # the dataloader picks the purchase<k> split at import
+    os.environ['PURCHASE_CLASSES'] = sys.argv[sys.argv.index("--classes")+1]
 
 
 import ctypes
@@ -22,9 +26,28 @@ lib.initialize_enclave.argtypes = []
 lib.destroy_enclave.argtypes = []
 
 lib.load_data.argtypes = [floatp, floatp, c_uint32, c_uint32]
+lib.load_data_file.argtypes = [c_char_p, c_uint32, c_uint32]
+lib.load_data_file.restype = c_int32
+lib.set_dataset_root.argtypes = [c_char_p]
+lib.set_dataset_root.restype = c_int32
 lib.xxhash.argtypes = [floatp, c_uint32]
 lib.xxhash.restype = c_uint64
 
+lib.append_rows.argtypes = [floatp, floatp, c_uint32]
+lib.append_rows.restype = c_int32
+lib.set_lazy_index.argtypes = [c_int32]
+lib.set_digest_check.argtypes = [c_int32]
+lib.set_optimizer.argtypes = [c_int32, c_float]
+lib.set_arch.argtypes = [c_char_p]
+lib.set_batch_autotune.argtypes = [c_char_p]
+lib.set_precision.argtypes = [c_int32]
+lib.set_workers.argtypes = [c_int32]
+lib.set_async.argtypes = [c_int32]
+lib.set_loss_report.argtypes = [c_int32]
+lib.set_threads.argtypes = [c_int32, c_int32]
+lib.thread_scaling.argtypes = [c_int32, c_int32]
+lib.contains.argtypes = [c_uint64]
+lib.contains.restype = c_int32
 lib.unlearning.argtypes = [c_uint64]
 
 lib.predict.argtypes = [floatp, floatp, c_uint32]
@@ -59,7 +82,46 @@ s = lib.initialize_enclave()
 print(data.shape)
 print(label.shape)
 
-lib.load_data(data, label, r, c)
+if "--mmap" in sys.argv:
+    raw_path = "./containers/default/train.raw"
+    dataloader.save_raw(raw_path, data, label)
+    lib.load_data_file(raw_path.encode(), r, c)
+elif "--chunked" in sys.argv:
+    chunked_path = "./containers/default/train.udst"
+    root = dataloader.save_chunked(chunked_path, data, label, codec='lz4' if "--lz4" in sys.argv else 'raw')
+    print("dataset root", root)
+    lib.set_dataset_root(root.encode())
+    lib.load_data_file(chunked_path.encode(), r, c)
+else:
+    lib.load_data(data, label, r, c)
+
+if "--lazy" in sys.argv:
+    lib.set_lazy_index(1)
+if "--recheck" in sys.argv:
+    lib.set_digest_check(1)
+if "--momentum" in sys.argv:
+    lib.set_optimizer(1, 0.01)
+elif "--adam" in sys.argv:
+    lib.set_optimizer(2, 0.001)
+if "--arch" in sys.argv:
+    # e.g. --arch 256,relu,64,relu,1,sigmoid
+    lib.set_arch(sys.argv[sys.argv.index("--arch")+1].encode())
+elif dataloader.num_class > 2:
+    lib.set_arch(("128,tanh,%d,softmax" % dataloader.num_class).encode())
+if "--bf16" in sys.argv:
+    lib.set_precision(1)
+if "--workers" in sys.argv:
+    lib.set_workers(int(sys.argv[sys.argv.index("--workers")+1]))
+if "--async" in sys.argv:
+    lib.set_async(1)
+if "--loss" in sys.argv:
+    lib.set_loss_report(1)
+if "--autotune" in sys.argv:
+    # the sealed choice is reused while arch, precision, workers and threads stay the same
+    lib.set_batch_autotune(b"./containers/default/batch.sealed")
+if "--threads" in sys.argv:
+    # compact pinning, the workers stay on the first cores
+    lib.set_threads(int(sys.argv[sys.argv.index("--threads")+1]), 1)
 
 start = time.time()
 
@@ -67,13 +129,24 @@ lib.init_enclave_storage()
 tick = time.time()
 print("training need time", tick-start)
 
+if "--scaling" in sys.argv:
+    lib.thread_scaling(int(sys.argv[sys.argv.index("--scaling")+1]), 20)
+
 data, label = dataloader.load([x for x in range(31152)])
 data = data.astype(np.float32)
 data = np.reshape(data, (-1,))
 label = label.astype(np.float32)
 lib.predict(data, label, 31152)
 
-
+if "--append" in sys.argv:
+    # the held out rows arrive later and are trained as new tail slices on the last checkpoint
+    new_data, new_label = dataloader.load([x for x in range(5000)], 'test')
+    new_data = np.reshape(new_data.astype(np.float32), (-1,))
+    new_label = new_label.astype(np.float32)
+    tick = time.time()
+    if lib.append_rows(new_data, new_label, 5000) == 0:
+        print("append need time", time.time()-tick)
+        lib.predict(data, label, 31152)
 
 for id in unlearning_ids:
     tick = time.time()